@@ -1,4 +1,5 @@
 #include "cppcomponents_libcurl_libuv.hpp"
+#include "implementation/scheduler.hpp"
 #include <curl/curl.h>
 
 #include <cppcomponents_libuv/cppcomponents_libuv.hpp>
@@ -6,8 +7,31 @@
 #include <array>
 #include <algorithm>
 #include <map>
+#include <memory>
+#include <functional>
+#include <condition_variable>
+#include <cstdlib>
+#include <cctype>
+#include <cstring>
+#include <cstdio>
 
 #include <thread>
+#include <mutex>
+#include <chrono>
+#include <deque>
+#include <list>
+#include <atomic>
+#include <unordered_map>
+#include <new>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 
 using namespace cppcomponents;
@@ -32,6 +56,11 @@ inline void curl_throw_if_error(CURLMcode code){
 		throw_if_error(-static_cast<error_code>(code));
 	}
 }
+inline void curl_throw_if_error(CURLSHcode code){
+	if (code != CURLSHE_OK){
+		throw_if_error(-static_cast<error_code>(code));
+	}
+}
 
 
 struct ImpSlist :implement_runtime_class<ImpSlist, Slist_t>{
@@ -41,7 +70,7 @@ struct ImpSlist :implement_runtime_class<ImpSlist, Slist_t>{
 	ImpSlist() :list_{ nullptr }{}
 
 	~ImpSlist(){
-		if (!list_){
+		if (list_){
 			curl_slist_free_all(list_);
 		}
 	}
@@ -157,13 +186,22 @@ struct ImpForm :implement_runtime_class<ImpForm, Form_t>{
 
 CPPCOMPONENTS_REGISTER(ImpForm)
 
-template<class Delegate>
- use<cppcomponents::delegate<Delegate>> DelegateFromVoid(void* userdata){
-	// user data is the delegate pointer
-	use<InterfaceUnknown> iunk{ cppcomponents::reinterpret_portable_base<InterfaceUnknown>(
-		static_cast<portable_base*>(userdata)), true };
-	return iunk.QueryInterface<Delegate>();
-}
+struct spin_lock{
+	std::atomic_flag flag_;
+
+	spin_lock(){
+		flag_.clear();
+	}
+	void lock(){
+		while (flag_.test_and_set(std::memory_order_acquire)){
+			std::this_thread::yield();
+		}
+	}
+	void unlock(){
+		flag_.clear(std::memory_order_release);
+	}
+};
+
  struct IImp :define_interface<cppcomponents::uuid<0xd9185c90, 0xd32e, 0x4909, 0xafaa, 0xc9a50557ae28>>
  {
 	 void* GetImp();
@@ -171,8 +209,120 @@ template<class Delegate>
 	 CPPCOMPONENTS_CONSTRUCT(IImp, GetImp);
  };
 
+inline std::string shareimp_id(){ return "cppcomponents_libcurl_libuv_dll!Share"; }
+typedef cppcomponents::runtime_class<shareimp_id, cppcomponents::object_interfaces<IShare, IImp>> ShareWithImp_t;
+
+struct ImpShare :implement_runtime_class<ImpShare, ShareWithImp_t>{
+
+	CURLSH* share_;
+
+	// The critical sections in libcurl are a few hash table operations, so a
+	// spin lock per data type is cheaper than a mutex
+	std::array<spin_lock, Constants::Share::CURL_LOCK_DATA_LAST> locks_;
+
+	// Multis that use this share, see Attach
+	std::mutex owners_mut_;
+	std::vector<const void*> owners_;
+	bool connect_;
+
+	static ImpShare& from_ishare(use<IShare>& share){
+		return *static_cast<ImpShare*>(share.QueryInterface<IImp>().GetImp());
+	}
+
+	void* IImp_GetImp(){
+		return this;
+	}
+
+	// libcurl's connection cache is not safe to use from more than one thread,
+	// so a share of CURL_LOCK_DATA_CONNECT belongs to a single multi
+	void Attach(const void* owner){
+		std::unique_lock<std::mutex> lock{ owners_mut_ };
+		if (std::find(owners_.begin(), owners_.end(), owner) != owners_.end()){
+			return;
+		}
+		if (connect_ && !owners_.empty()){
+			throw error_invalid_arg();
+		}
+		owners_.push_back(owner);
+	}
+
+	void Detach(const void* owner){
+		std::unique_lock<std::mutex> lock{ owners_mut_ };
+		owners_.erase(std::remove(owners_.begin(), owners_.end(), owner), owners_.end());
+	}
+
+	bool SharesConnections(){
+		std::unique_lock<std::mutex> lock{ owners_mut_ };
+		return connect_;
+	}
+
+	static void lock_function(CURL*, curl_lock_data data, curl_lock_access, void* userp){
+		static_cast<ImpShare*>(userp)->locks_[data].lock();
+	}
+
+	static void unlock_function(CURL*, curl_lock_data data, void* userp){
+		static_cast<ImpShare*>(userp)->locks_[data].unlock();
+	}
+
+	ImpShare() :share_{ curl_share_init() }, connect_{ false }{
+		if (!share_){
+			throw error_fail();
+		}
+		void* pthis = this;
+		curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, lock_function);
+		curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, unlock_function);
+		curl_share_setopt(share_, CURLSHOPT_USERDATA, pthis);
+	}
+
+	~ImpShare(){
+		if (share_){
+			curl_share_cleanup(share_);
+		}
+	}
+
+	void Share(std::int32_t data){
+		if (data <= Constants::Share::CURL_LOCK_DATA_SHARE || data >= Constants::Share::CURL_LOCK_DATA_LAST){
+			throw error_invalid_arg();
+		}
+		std::unique_lock<std::mutex> lock{ owners_mut_ };
+		if (data == Constants::Share::CURL_LOCK_DATA_CONNECT && owners_.size() > 1){
+			throw error_invalid_arg();
+		}
+		auto res = curl_share_setopt(share_, CURLSHOPT_SHARE, static_cast<curl_lock_data>(data));
+		curl_throw_if_error(res);
+		if (data == Constants::Share::CURL_LOCK_DATA_CONNECT){
+			connect_ = true;
+		}
+	}
+
+	void Unshare(std::int32_t data){
+		if (data <= Constants::Share::CURL_LOCK_DATA_SHARE || data >= Constants::Share::CURL_LOCK_DATA_LAST){
+			throw error_invalid_arg();
+		}
+		std::unique_lock<std::mutex> lock{ owners_mut_ };
+		auto res = curl_share_setopt(share_, CURLSHOPT_UNSHARE, static_cast<curl_lock_data>(data));
+		curl_throw_if_error(res);
+		if (data == Constants::Share::CURL_LOCK_DATA_CONNECT){
+			connect_ = false;
+		}
+	}
+
+	void* GetNative(){
+		return share_;
+	}
+};
+
+CPPCOMPONENTS_REGISTER(ImpShare)
+
+template<class Delegate>
+ use<cppcomponents::delegate<Delegate>> DelegateFromVoid(void* userdata){
+	// user data is the delegate pointer
+	use<InterfaceUnknown> iunk{ cppcomponents::reinterpret_portable_base<InterfaceUnknown>(
+		static_cast<portable_base*>(userdata)), true };
+	return iunk.QueryInterface<Delegate>();
+}
  inline std::string easyimp_id(){ return "cppcomponents_libcurl_libuv_dll!Easy"; }
- typedef cppcomponents::runtime_class<easyimp_id, cppcomponents::object_interfaces<IEasy,IImp>> EasyWithImp_t;
+ typedef cppcomponents::runtime_class<easyimp_id, cppcomponents::object_interfaces<IEasy,IEasy2,IImp>> EasyWithImp_t;
  typedef cppcomponents::use_runtime_class<EasyWithImp_t> EasyWithImp;;
 
  struct ImpEasy :implement_runtime_class<ImpEasy, EasyWithImp_t>
@@ -181,6 +331,12 @@ template<class Delegate>
 
 
 	 use<IForm> form_;
+	 // Copy of CURLOPT_URL, libcurl has no way to read it back before the transfer starts
+	 std::string url_;
+	 // Released after curl_easy_cleanup, a share cannot be cleaned up while in use
+	 use<IShare> share_;
+	 // libcurl does not copy the CURLOPT_HTTPHEADER list
+	 use<ISlist> http_headers_;
 
 	 std::array<char, CURL_ERROR_SIZE + 1> error_buffer_;
 
@@ -191,14 +347,39 @@ template<class Delegate>
 
 	 std::map < const void*, use<InterfaceUnknown> > extra_info_;
 
+	 // Set while added to a multi, only touched on the loop thread of that multi
+	 use<Callbacks::CompletedFunction> completed_;
+	 use<IMulti> multi_;
+	 // Set while acquired from a pool
+	 use<IEasyPool> pool_;
+
+	 std::int32_t priority_;
+	 // queued_at_ is set by IMulti::Add, queue_wait_ when the transfer starts
+	 std::chrono::steady_clock::time_point queued_at_;
+	 std::chrono::steady_clock::duration queue_wait_;
+	 // Filled by the multi when the transfer completes, indexed by TimingValue
+	 std::array<double, TimingValue::Count> timings_;
+	 // Scheduler state of the multi, only touched on its loop thread
+	 std::string host_;
+	 bool waiting_;
+	 // The multi a MultiGroup handed the transfer to, read by Remove and Pause on any thread
+	 std::atomic<const void*> group_multi_;
+	 // The ImpMulti running the transfer and the count of transfers, set on
+	 // its loop thread and read by Pause on the loop thread of any multi
+	 std::atomic<const void*> running_in_;
+	 std::atomic<std::uint64_t> transfer_;
+
+	 // CURLOPT_PRIVATE is this, no reference count or QueryInterface
 	static ImpEasy* impeasy_from_easy(CURL* easy){
 		 char* charpeasy = 0;
 		 curl_easy_getinfo(easy, CURLINFO_PRIVATE, &charpeasy);
-		 void* vpeasy = charpeasy;
-		 auto iunk = use<InterfaceUnknown>{reinterpret_portable_base<InterfaceUnknown>(static_cast<portable_base*>(vpeasy)), true};
-		 return static_cast<ImpEasy*>(iunk.QueryInterface<IImp>().GetImp());
+		 return reinterpret_cast<ImpEasy*>(charpeasy);
 	 }
 
+	static ImpEasy& from_ieasy(use<IEasy>& easy){
+		return *static_cast<ImpEasy*>(easy.QueryInterface<IImp>().GetImp());
+	}
+
 
 	void* IImp_GetImp(){
 		return this;
@@ -207,7 +388,7 @@ template<class Delegate>
 	void Init(){
 
 		 // Set the private of easy to interface
-		 auto res = curl_easy_setopt(easy_, CURLOPT_PRIVATE, this->get_unknown_portable_base());
+		 auto res = curl_easy_setopt(easy_, CURLOPT_PRIVATE, static_cast<void*>(this));
 		 curl_throw_if_error(res);
 		 
 		 std::fill(error_buffer_.begin(), error_buffer_.end(), 0);
@@ -216,14 +397,28 @@ template<class Delegate>
 
 	 ImpEasy()
 		 :
-		 easy_{ curl_easy_init() }
+		 easy_{ curl_easy_init() }, priority_{ TransferPriority::Normal }, queue_wait_{}, waiting_{ false },
+		 group_multi_{ nullptr }, running_in_{ nullptr }, transfer_{ 0 }
 	 {
+		 timings_.fill(0);
 		 if (!easy_){
 			 throw error_fail();
 		 }
 
 	 }
 
+	 // Takes ownership of easy
+	 explicit ImpEasy(CURL* easy)
+		 :
+		 easy_{ easy }, priority_{ TransferPriority::Normal }, queue_wait_{}, waiting_{ false },
+		 group_multi_{ nullptr }, running_in_{ nullptr }, transfer_{ 0 }
+	 {
+		 timings_.fill(0);
+		 if (!easy_){
+			 throw error_fail();
+		 }
+	 }
+
 	 ~ImpEasy(){
 		 if (easy_){
 			 curl_easy_cleanup(easy_);
@@ -240,6 +435,7 @@ template<class Delegate>
 			 option == CURLOPT_PROGRESSDATA ||
 			 option == CURLOPT_HEADERDATA ||
 			 option == CURLOPT_PRIVATE ||
+			 option == CURLOPT_CLOSESOCKETDATA ||
 			 option == CURLOPT_ERRORBUFFER
 			 )
 		 {
@@ -254,6 +450,34 @@ template<class Delegate>
 			 curl_throw_if_error(res);
 
 		 }
+		 else if (option == CURLOPT_SHARE){
+			 if (parameter == nullptr){
+				 auto res = curl_easy_setopt(easy_, CURLOPT_SHARE, static_cast<CURLSH*>(nullptr));
+				 curl_throw_if_error(res);
+				 share_ = nullptr;
+			 }
+			 else{
+				 auto pb = static_cast<portable_base*>(parameter);
+				 use<InterfaceUnknown> iunk{ cppcomponents::reinterpret_portable_base<InterfaceUnknown>(pb), true };
+				 auto share = iunk.QueryInterface<IShare>();
+				 auto res = curl_easy_setopt(easy_, CURLOPT_SHARE, static_cast<CURLSH*>(share.GetNative()));
+				 curl_throw_if_error(res);
+				 share_ = share;
+			 }
+			 return;
+		 }
+		 else if (option == CURLOPT_HTTPHEADER){
+			 use<ISlist> slist;
+			 if (parameter){
+				 auto pb = static_cast<portable_base*>(parameter);
+				 use<InterfaceUnknown> iunk{ cppcomponents::reinterpret_portable_base<InterfaceUnknown>(pb), true };
+				 slist = iunk.QueryInterface<ISlist>();
+			 }
+			 auto res = curl_easy_setopt(easy_, CURLOPT_HTTPHEADER, slist ? static_cast<curl_slist*>(slist.GetNative()) : nullptr);
+			 curl_throw_if_error(res);
+			 http_headers_ = slist;
+			 return;
+		 }
 		 else if (option == CURLOPT_HEADER){
 			 if (parameter == nullptr){
 				 auto res = curl_easy_setopt(easy_, static_cast<CURLoption>(option), nullptr);
@@ -271,6 +495,9 @@ template<class Delegate>
 		 }
 		 auto res = curl_easy_setopt(easy_, static_cast<CURLoption>(option), parameter);
 		 curl_throw_if_error(res);
+		 if (option == CURLOPT_URL){
+			 url_ = parameter ? static_cast<const char*>(parameter) : "";
+		 }
 
 	 }
 	 void SetInt64Option(std::int32_t option, std::int64_t parameter){
@@ -426,17 +653,186 @@ template<class Delegate>
 
 	 void Reset(){
 		 curl_easy_reset(easy_);
+		 url_.clear();
+		 http_headers_ = nullptr;
+		 priority_ = TransferPriority::Normal;
+		 queue_wait_ = std::chrono::steady_clock::duration{};
+		 timings_.fill(0);
 		 Init();
 	 }
 
+	 // Infos of the last transfer, indexed by TimingValue. succeeded tells if it
+	 // completed with CURLE_OK
+	 void ReadTimings(std::array<double, TimingValue::Count>& t, bool succeeded){
+		 t[TimingValue::QueueWait] = GetQueueTime();
+		 curl_easy_getinfo(easy_, CURLINFO_NAMELOOKUP_TIME, &t[TimingValue::NameLookup]);
+		 curl_easy_getinfo(easy_, CURLINFO_CONNECT_TIME, &t[TimingValue::Connect]);
+		 curl_easy_getinfo(easy_, CURLINFO_APPCONNECT_TIME, &t[TimingValue::AppConnect]);
+		 curl_easy_getinfo(easy_, CURLINFO_STARTTRANSFER_TIME, &t[TimingValue::StartTransfer]);
+		 curl_easy_getinfo(easy_, CURLINFO_TOTAL_TIME, &t[TimingValue::Total]);
+		 curl_easy_getinfo(easy_, CURLINFO_SIZE_UPLOAD, &t[TimingValue::BytesUploaded]);
+		 curl_easy_getinfo(easy_, CURLINFO_SIZE_DOWNLOAD, &t[TimingValue::BytesDownloaded]);
+		 // No new connection says nothing if the transfer never got as far as
+		 // having one, say because the name did not resolve
+		 if (t[TimingValue::Connect] > 0 || succeeded){
+			 long connects = 0;
+			 curl_easy_getinfo(easy_, CURLINFO_NUM_CONNECTS, &connects);
+			 t[TimingValue::ConnectionReused] = connects == 0 ? 1 : 0;
+		 }
+		 else{
+			 t[TimingValue::ConnectionReused] = -1;
+		 }
+	 }
+
+	 void SetPriority(std::int32_t priority){
+		 if (priority < 0 || priority >= TransferPriority::Count){
+			 throw error_invalid_arg();
+		 }
+		 priority_ = priority;
+	 }
+	 std::int32_t GetPriority(){
+		 return priority_;
+	 }
+	 double GetQueueTime(){
+		 return std::chrono::duration<double>(queue_wait_).count();
+	 }
+	 std::uint64_t GetTransfer(){
+		 return transfer_.load(std::memory_order_acquire);
+	 }
+
+	 use<IEasy> Duplicate(){
+		 auto dup = curl_easy_duphandle(easy_);
+		 if (!dup){
+			 throw error_fail();
+		 }
+		 use<IEasy> ret;
+		 try{
+			 ret = ImpEasy::create(dup).QueryInterface<IEasy>();
+		 }
+		 catch (...){
+			 curl_easy_cleanup(dup);
+			 throw;
+		 }
+		 auto& imp = from_ieasy(ret);
+		 // The copied handle shares the form, header list and share with this one
+		 imp.form_ = form_;
+		 imp.share_ = share_;
+		 imp.http_headers_ = http_headers_;
+		 imp.url_ = url_;
+		 imp.priority_ = priority_;
+		 // libcurl copied our private pointer, error buffer and callback data
+		 imp.Init();
+		 if (write_function_){
+			 imp.write_function_ = write_function_;
+			 imp.SetFunctionData(CURLOPT_WRITEDATA, CURLOPT_WRITEFUNCTION, WriteFunctionRaw);
+		 }
+		 if (read_function_){
+			 imp.read_function_ = read_function_;
+			 imp.SetFunctionData(CURLOPT_READDATA, CURLOPT_READFUNCTION, ReadFunctionRaw);
+		 }
+		 if (header_function_){
+			 imp.header_function_ = header_function_;
+			 imp.SetFunctionData(CURLOPT_HEADERDATA, CURLOPT_HEADERFUNCTION, HeaderFunctionRaw);
+		 }
+		 if (progress_function_){
+			 imp.progress_function_ = progress_function_;
+			 imp.SetFunctionData(CURLOPT_PROGRESSDATA, CURLOPT_PROGRESSFUNCTION, ProgressFunctionRaw);
+		 }
+		 return ret;
+	 }
+
 
 };
 
 CPPCOMPONENTS_REGISTER(ImpEasy)
 
+struct ImpEasyPool :implement_runtime_class<ImpEasyPool, EasyPool_t>
+{
+	std::mutex mut_;
+	std::vector<use<IEasy>> idle_;
+	std::uint32_t max_idle_;
+	std::uint32_t outstanding_;
+	std::uint32_t high_water_;
+	std::uint64_t created_;
+
+	ImpEasyPool(std::uint32_t max_idle)
+		:max_idle_{ max_idle }, outstanding_{ 0 }, high_water_{ 0 }, created_{ 0 }
+	{
+		idle_.reserve(max_idle_);
+	}
+
+	use<IEasy> Acquire(){
+		use<IEasy> easy;
+		{
+			std::unique_lock<std::mutex> lock{ mut_ };
+			if (!idle_.empty()){
+				easy = idle_.back();
+				idle_.pop_back();
+			}
+			else{
+				++created_;
+			}
+			++outstanding_;
+			if (outstanding_ > high_water_){
+				high_water_ = outstanding_;
+			}
+		}
+		try{
+			if (!easy){
+				easy = Easy{};
+				easy.Reset();
+			}
+			// Lets IMulti give the handle back once the transfer has completed
+			ImpEasy::from_ieasy(easy).pool_ = QueryInterface<IEasyPool>();
+		}
+		catch (...){
+			std::unique_lock<std::mutex> lock{ mut_ };
+			--outstanding_;
+			throw;
+		}
+		return easy;
+	}
+
+	void Release(use<IEasy> easy){
+		auto& imp = ImpEasy::from_ieasy(easy);
+		if (imp.pool_.get_portable_base() != QueryInterface<IEasyPool>().get_portable_base()){
+			// Not acquired from this pool or already released
+			throw error_invalid_arg();
+		}
+		imp.pool_ = nullptr;
+		// Reset outside the lock, this keeps live connections and the DNS and
+		// TLS session caches of the handle
+		easy.Reset();
+		std::unique_lock<std::mutex> lock{ mut_ };
+		--outstanding_;
+		if (idle_.size() < max_idle_){
+			idle_.push_back(easy);
+		}
+	}
+
+	std::uint32_t Size(){
+		std::unique_lock<std::mutex> lock{ mut_ };
+		return static_cast<std::uint32_t>(idle_.size());
+	}
+	std::uint32_t Outstanding(){
+		std::unique_lock<std::mutex> lock{ mut_ };
+		return outstanding_;
+	}
+	std::uint32_t HighWater(){
+		std::unique_lock<std::mutex> lock{ mut_ };
+		return high_water_;
+	}
+	std::uint64_t Created(){
+		std::unique_lock<std::mutex> lock{ mut_ };
+		return created_;
+	}
+};
+
+CPPCOMPONENTS_REGISTER(ImpEasyPool)
+
 
 inline std::string multi_id(){ return "cppcomponents_libcurl_libuv_dll!Multi"; }
-typedef cppcomponents::runtime_class<multi_id, cppcomponents::object_interfaces<IMulti, IImp>> Multi_t;
+typedef cppcomponents::runtime_class<multi_id, cppcomponents::object_interfaces<IMulti, IMulti2, IImp, IMultiStats>> Multi_t;
 typedef cppcomponents::use_runtime_class<Multi_t> Multi;
 
 
@@ -445,17 +841,163 @@ typedef cppcomponents::use_runtime_class<Multi_t> Multi;
 //typedef cppcomponents::use_runtime_class<Response_t> Response;
 
 
+// Free list of body segments, so a steady stream of responses does not allocate
+struct body_segment_pool{
+	// Matches CURL_MAX_WRITE_SIZE, the largest chunk passed to a write callback
+	static const std::size_t segment_size = 16 * 1024;
+	static const std::size_t max_segments = 1024;
+
+	std::mutex mut_;
+	std::vector<use<IBuffer>> segments_;
+
+	static body_segment_pool& get(){
+		struct uniq{};
+		return cross_compiler_interface::detail::safe_static_init<body_segment_pool, uniq>::get();
+	}
+
+	use<IBuffer> Acquire(){
+		{
+			std::unique_lock<std::mutex> lock{ mut_ };
+			if (!segments_.empty()){
+				auto b = segments_.back();
+				segments_.pop_back();
+				return b;
+			}
+		}
+		auto b = Buffer::Create(segment_size);
+		b.SetSize(0);
+		return b;
+	}
+
+	void Release(std::vector<use<IBuffer>>& segments){
+		std::unique_lock<std::mutex> lock{ mut_ };
+		for (auto& b : segments){
+			if (segments_.size() >= max_segments){
+				break;
+			}
+			b.SetSize(0);
+			segments_.push_back(b);
+		}
+		segments.clear();
+	}
+};
+
 struct ImpResponse :implement_runtime_class<ImpResponse, Response_t>
 {
+	// Content-Length comes from the server, so it sizes at most this much of the first segment
+	static const std::uint64_t max_presize = 4 * 1024 * 1024;
+
 	use<IEasy> easy_;
-	std::vector<char> body_;
-	std::vector<std::pair<std::string, std::string>> headers_;
+	std::vector<use<IBuffer>> segments_;
+	// Capacity of segments_.back(), the only segment still being written
+	std::size_t tail_capacity_;
+	// Segments of body_segment_pool::segment_size that nobody else has seen
+	bool segments_pooled_;
+	std::uint64_t body_size_;
+	// Content-Length of the last response in a redirect chain, 0 if it had none
+	std::uint64_t length_hint_;
+
+	// Offsets into raw_headers_, which holds the header lines without their CRLF
+	struct header_entry{
+		std::uint32_t name_begin;
+		std::uint32_t name_size;
+		std::uint32_t value_begin;
+		std::uint32_t value_size;
+	};
+	std::string raw_headers_;
+	std::vector<header_entry> header_entries_;
+	// Open addressing table of header_entries_ index + 1, 0 marks an empty slot
+	// Built on the first Header lookup
+	std::vector<std::uint32_t> header_index_;
 	cppcomponents::error_code ec_;
+	bool completed_;
+	std::int32_t response_code_;
+	std::string error_message_;
+	double queue_time_;
+	std::vector<double> timings_;
+
+	ImpResponse(use<IEasy> e) :easy_{ e }, tail_capacity_{ 0 }, segments_pooled_{ true }, body_size_{ 0 },
+		length_hint_{ 0 }, ec_{ 0 }, completed_{ false }, response_code_{ 0 }, queue_time_{ 0 }{}
+
+	~ImpResponse(){
+		if (segments_pooled_){
+			body_segment_pool::get().Release(segments_);
+		}
+	}
 
-	ImpResponse(use<IEasy> e) :easy_{ e }, ec_{ 0 }{}
+	void AddSegment(std::size_t capacity){
+		if (capacity == body_segment_pool::segment_size && segments_pooled_){
+			segments_.push_back(body_segment_pool::get().Acquire());
+		}
+		else{
+			segments_.push_back(Buffer::Create(capacity));
+			segments_.back().SetSize(0);
+			segments_pooled_ = false;
+		}
+		tail_capacity_ = capacity;
+	}
 
 	void IResponseWriter_AddToBody(const char* first, const char* last){
-		body_.insert(body_.end(), first, last);
+		if (segments_.empty() && first != last){
+			AddFirstSegment();
+		}
+		while (first != last){
+			if (segments_.back().Size() == tail_capacity_){
+				AddSegment(body_segment_pool::segment_size);
+			}
+			auto& tail = segments_.back();
+			auto used = tail.Size();
+			auto n = std::min<std::size_t>(last - first, tail_capacity_ - used);
+			std::copy(first, first + n, tail.Begin() + used);
+			tail.SetSize(used + n);
+			first += n;
+			body_size_ += n;
+		}
+	}
+
+	// Sized by Content-Length when the body is known to be large. Only allocated
+	// once the body arrives, so HEAD, 304 and streamed responses cost nothing. A
+	// compressed or chunked body may still outgrow it and continue in regular segments
+	void AddFirstSegment(){
+		auto length = length_hint_;
+		if (length > max_presize){
+			length = max_presize;
+		}
+		if (length <= body_segment_pool::segment_size){
+			AddSegment(body_segment_pool::segment_size);
+		}
+		else{
+			AddSegment(static_cast<std::size_t>(length));
+		}
+	}
+
+	static bool iequals(const char* a, std::size_t na, const char* b, std::size_t nb){
+		if (na != nb){
+			return false;
+		}
+		for (std::size_t i = 0; i < na; ++i){
+			if (std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i]))){
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// FNV-1a over the lower cased name
+	static std::uint32_t ihash(const char* p, std::size_t n){
+		std::uint32_t h = 2166136261u;
+		for (std::size_t i = 0; i < n; ++i){
+			h ^= static_cast<std::uint32_t>(std::tolower(static_cast<unsigned char>(p[i])));
+			h *= 16777619u;
+		}
+		return h;
+	}
+
+	cr_string name_of(const header_entry& e){
+		return cr_string{ raw_headers_.data() + e.name_begin, e.name_size };
+	}
+	cr_string value_of(const header_entry& e){
+		return cr_string{ raw_headers_.data() + e.value_begin, e.value_size };
 	}
 
 	void IResponseWriter_AddToHeader(const char* first, const char* last){
@@ -464,14 +1006,31 @@ struct ImpResponse :implement_runtime_class<ImpResponse, Response_t>
                 return;
             }
         }
-		auto colon = std::find(first, last, ':');
-		std::string name{ first, colon };
-		if (colon != last){
-			++colon;
-		}
         static char rn[] = { '\r', '\n' }; 
-		std::string value{ colon, std::search(colon,last,rn,rn+2) };
-		headers_.push_back(std::make_pair(name, value));
+		auto end = std::search(first, last, rn, rn + 2);
+		auto colon = std::find(first, end, ':');
+		auto value_begin = (colon == end) ? end : colon + 1;
+
+		auto base = static_cast<std::uint32_t>(raw_headers_.size());
+		raw_headers_.append(first, end);
+		header_entry e;
+		e.name_begin = base;
+		e.name_size = static_cast<std::uint32_t>(colon - first);
+		e.value_begin = base + static_cast<std::uint32_t>(value_begin - first);
+		e.value_size = static_cast<std::uint32_t>(end - value_begin);
+		header_entries_.push_back(e);
+		header_index_.clear();
+
+		static const char content_length[] = "content-length";
+		static const char status[] = "HTTP/";
+		if (iequals(first, colon - first, content_length, sizeof(content_length) - 1)){
+			std::string value{ value_begin, end };
+			length_hint_ = std::strtoull(value.c_str(), nullptr, 10);
+		}
+		else if (end - first >= 5 && std::equal(status, status + 5, first)){
+			// A new response of a redirect chain or after 100 Continue
+			length_hint_ = 0;
+		}
 	}
 	
 	void IResponseWriter_SetError(cppcomponents::error_code ec){
@@ -483,67 +1042,514 @@ struct ImpResponse :implement_runtime_class<ImpResponse, Response_t>
 		}
 	}
 
+	void IResponseWriter2_Complete(cppcomponents::error_code ec){
+		if (ec != 0){
+			IResponseWriter_SetError(ec);
+		}
+		response_code_ = easy_.GetInt32Info(CURLINFO_RESPONSE_CODE);
+		error_message_ = easy_.GetErrorDescription().to_string();
+		queue_time_ = ImpEasy::from_ieasy(easy_).GetQueueTime();
+		auto& imp = ImpEasy::from_ieasy(easy_);
+		timings_.assign(imp.timings_.begin(), imp.timings_.end());
+		completed_ = true;
+	}
+
 	void* IImp_GetImp(){
 		return this;
 	}
 
+	void IResponseWriter2_CompleteFrom(std::int32_t response_code, std::vector<std::pair<std::string, std::string>> headers,
+		std::vector<use<IBuffer>> body){
+		if (completed_ || body_size_ || !header_entries_.empty()){
+			throw error_fail();
+		}
+		for (auto& h : headers){
+			auto base = static_cast<std::uint32_t>(raw_headers_.size());
+			raw_headers_.append(h.first);
+			if (!h.second.empty()){
+				raw_headers_.push_back(':');
+				raw_headers_.append(h.second);
+			}
+			header_entry e;
+			e.name_begin = base;
+			e.name_size = static_cast<std::uint32_t>(h.first.size());
+			e.value_begin = base + e.name_size + (h.second.empty() ? 0 : 1);
+			e.value_size = static_cast<std::uint32_t>(h.second.size());
+			header_entries_.push_back(e);
+		}
+		header_index_.clear();
+		if (segments_pooled_){
+			body_segment_pool::get().Release(segments_);
+		}
+		segments_ = std::move(body);
+		segments_pooled_ = false;
+		body_size_ = 0;
+		for (auto& b : segments_){
+			body_size_ += b.Size();
+		}
+		tail_capacity_ = segments_.empty() ? 0 : segments_.back().Size();
+		response_code_ = response_code;
+		completed_ = true;
+	}
+
 	cppcomponents::error_code ErrorCode(){
 		return ec_;
 	}
 
 	cppcomponents::cr_string ErrorMessage(){
+		if (completed_){
+			return cr_string{ error_message_ };
+		}
 		return easy_.GetErrorDescription();
 	}
 
+	std::int32_t StatusCode(){
+		if (completed_){
+			return response_code_;
+		}
+		return easy_.GetInt32Info(CURLINFO_RESPONSE_CODE);
+	}
+
+	double QueueTime(){
+		if (completed_){
+			return queue_time_;
+		}
+		return ImpEasy::from_ieasy(easy_).GetQueueTime();
+	}
+
+	std::vector<double> TimingValues(){
+		if (completed_){
+			return timings_;
+		}
+		std::array<double, TimingValue::Count> t;
+		ImpEasy::from_ieasy(easy_).ReadTimings(t, false);
+		return std::vector<double>(t.begin(), t.end());
+	}
+
 	cppcomponents::use<IEasy> Request(){
 		return easy_;
 	}
 	cppcomponents::cr_string Body(){
 		throw_if_error(ec_);
-		if (!body_.size()){
+		if (!body_size_){
 			return cr_string{};
 		}
-		return cr_string{ &body_[0], body_.size() };
+		if (segments_.size() > 1){
+			// Flatten once, later calls see a single segment
+			auto flat = Buffer::Create(static_cast<std::size_t>(body_size_));
+			auto out = flat.Begin();
+			for (auto& b : segments_){
+				out = std::copy(b.Begin(), b.Begin() + b.Size(), out);
+			}
+			flat.SetSize(static_cast<std::size_t>(body_size_));
+			if (segments_pooled_){
+				body_segment_pool::get().Release(segments_);
+			}
+			segments_.clear();
+			segments_.push_back(flat);
+			tail_capacity_ = static_cast<std::size_t>(body_size_);
+			segments_pooled_ = false;
+		}
+		auto& b = segments_.front();
+		return cr_string{ b.Begin(), b.Size() };
 	}
 
-	std::vector<std::pair<std::string, std::string>> Headers(){
+	std::vector<use<IBuffer>> BodyBuffers(){
 		throw_if_error(ec_);
-		return headers_;
+		// The caller may keep these, so they can no longer go back to the pool
+		segments_pooled_ = false;
+		return segments_;
 	}
 
+	std::uint64_t BodySize(){
+		throw_if_error(ec_);
+		return body_size_;
+	}
 
-};
-CPPCOMPONENTS_REGISTER(ImpResponse)
+	std::vector<std::pair<std::string, std::string>> Headers(){
+		throw_if_error(ec_);
+		std::vector<std::pair<std::string, std::string>> headers;
+		headers.reserve(header_entries_.size());
+		for (auto& e : header_entries_){
+			headers.push_back(std::make_pair(name_of(e).to_string(), value_of(e).to_string()));
+		}
+		return headers;
+	}
 
+	void BuildHeaderIndex(){
+		std::size_t size = 8;
+		while (size < header_entries_.size() * 2){
+			size *= 2;
+		}
+		header_index_.assign(size, 0);
+		auto mask = size - 1;
+		for (std::uint32_t i = 0; i < header_entries_.size(); ++i){
+			auto name = name_of(header_entries_[i]);
+			for (auto slot = ihash(name.data(), name.size()) & mask;; slot = (slot + 1) & mask){
+				auto& idx = header_index_[slot];
+				// A later header with the same name replaces the earlier one, after a
+				// redirect this is the header of the final response
+				if (idx == 0 || iequals(name.data(), name.size(),
+					raw_headers_.data() + header_entries_[idx - 1].name_begin, header_entries_[idx - 1].name_size)){
+					idx = i + 1;
+					break;
+				}
+			}
+		}
+	}
 
-struct ImpMulti :implement_runtime_class<ImpMulti, Multi_t>
-{
-	static const int pollid = 0;
-	static const int callbackid = 0;
-	static const int selfid = 0;
-	bool own_executor_;
-	use<uv::IUvExecutor> executor_;
-	std::thread thread_;
+	cppcomponents::cr_string Header(cppcomponents::cr_string name){
+		throw_if_error(ec_);
+		if (header_entries_.empty()){
+			return cr_string{};
+		}
+		if (header_index_.empty()){
+			BuildHeaderIndex();
+		}
+		auto mask = header_index_.size() - 1;
+		for (auto slot = ihash(name.data(), name.size()) & mask;; slot = (slot + 1) & mask){
+			auto idx = header_index_[slot];
+			if (idx == 0){
+				return cr_string{};
+			}
+			auto& e = header_entries_[idx - 1];
+			if (iequals(name.data(), name.size(), raw_headers_.data() + e.name_begin, e.name_size)){
+				auto first = raw_headers_.data() + e.value_begin;
+				auto last = first + e.value_size;
+				while (first != last && std::isspace(static_cast<unsigned char>(*first))){
+					++first;
+				}
+				while (first != last && std::isspace(static_cast<unsigned char>(*(last - 1)))){
+					--last;
+				}
+				return cr_string{ first, static_cast<std::size_t>(last - first) };
+			}
+		}
+	}
 
-	CURLM* multi_;
+	std::uint32_t HeaderCount(){
+		throw_if_error(ec_);
+		return static_cast<std::uint32_t>(header_entries_.size());
+	}
 
-	use<uv::ITimer> timeout_;
+	cppcomponents::cr_string HeaderName(std::uint32_t index){
+		throw_if_error(ec_);
+		if (index >= header_entries_.size()){
+			throw error_invalid_arg();
+		}
+		return name_of(header_entries_[index]);
+	}
 
-	static use<IEasy> ieasy_from_easy(CURL* easy){
-		char* charpeasy = 0;
-		curl_easy_getinfo(easy, CURLINFO_PRIVATE, &charpeasy);
-		void* vpeasy = charpeasy;
-		auto iunk = use<InterfaceUnknown>{reinterpret_portable_base<InterfaceUnknown>(static_cast<portable_base*>(vpeasy)), true};
-		return iunk.QueryInterface<IEasy>();
+	cppcomponents::cr_string HeaderValue(std::uint32_t index){
+		throw_if_error(ec_);
+		if (index >= header_entries_.size()){
+			throw error_invalid_arg();
+		}
+		return value_of(header_entries_[index]);
 	}
 
-	static void curl_perform(use<uv::IPoll>, int status, int events, curl_socket_t sockfd, ImpMulti* pthis)
-	{
-		int running_handles;
+
+};
+CPPCOMPONENTS_REGISTER(ImpResponse)
+
+
+// Host and port of url, used to group transfers by server
+inline std::string host_from_url(const std::string& url){
+	auto begin = url.find("://");
+	begin = (begin == std::string::npos) ? 0 : begin + 3;
+	auto end = url.find_first_of("/?#", begin);
+	return url.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+}
+
+// Poll handles of the sockets a multi opened. libcurl closes a socket with the
+// callbacks of the transfer that opened it, which for a shared connection
+// cache may run on another thread or after the multi is gone. The registry
+// counts the open sockets and lives until the multi and all of them are gone,
+// and polls is only touched on the loop thread
+struct socket_registry{
+	typedef std::unordered_map<curl_socket_t, use<uv::IPoll>> poll_table;
+
+	// Once assigned libcurl passes the entry back as socketp, and a kept-alive
+	// socket keeps its poll between transfers until libcurl closes it
+	poll_table polls;
+
+	std::mutex mut;
+	std::thread::id loop_thread;
+	// The multi and each open socket
+	std::size_t references;
+	bool multi_alive;
+	// Closed on other threads, their polls are dropped on the loop thread
+	std::vector<curl_socket_t> closed;
+	std::atomic<bool> has_closed;
+
+	socket_registry() :references{ 1 }, multi_alive{ true }, has_closed{ false }{}
+
+	static void stop(use<uv::IPoll>& poll){
+		try{
+			poll.Stop();
+		}
+		catch (...){
+			// swallow exceptions
+		}
+	}
+
+	// Runs on the loop thread
+	void drop(curl_socket_t s){
+		auto iter = polls.find(s);
+		if (iter != polls.end()){
+			stop(iter->second);
+			polls.erase(iter);
+		}
+	}
+
+	// Runs on the loop thread, before a socket number is looked up in polls
+	void drop_closed(){
+		if (!has_closed.load(std::memory_order_acquire)){
+			return;
+		}
+		std::unique_lock<std::mutex> lock{ mut };
+		for (auto s : closed){
+			drop(s);
+		}
+		closed.clear();
+		has_closed.store(false, std::memory_order_relaxed);
+	}
+
+	void release(){
+		bool last;
+		{
+			std::unique_lock<std::mutex> lock{ mut };
+			last = --references == 0;
+		}
+		if (last){
+			delete this;
+		}
+	}
+
+	// Runs on the loop thread once curl_multi_cleanup has closed the connections
+	// of the multi. Sockets still open elsewhere only keep the registry alive
+	void shutdown(){
+		{
+			std::unique_lock<std::mutex> lock{ mut };
+			for (auto& p : polls){
+				stop(p.second);
+			}
+			polls.clear();
+			closed.clear();
+			multi_alive = false;
+		}
+		release();
+	}
+
+	// CURLOPT_OPENSOCKETFUNCTION
+	static curl_socket_t open_socket(void* clientp, curlsocktype, struct curl_sockaddr* address){
+		auto s = socket(address->family, address->socktype, address->protocol);
+		if (s != CURL_SOCKET_BAD){
+			auto reg = static_cast<socket_registry*>(clientp);
+			std::unique_lock<std::mutex> lock{ reg->mut };
+			++reg->references;
+		}
+		return s;
+	}
+
+	// CURLOPT_CLOSESOCKETFUNCTION, the poll has to be stopped before the socket
+	// is closed
+	static int close_socket(void* clientp, curl_socket_t s){
+		auto reg = static_cast<socket_registry*>(clientp);
+		{
+			std::unique_lock<std::mutex> lock{ reg->mut };
+			if (reg->multi_alive){
+				if (std::this_thread::get_id() == reg->loop_thread){
+					reg->drop(s);
+				}
+				else{
+					// libcurl no longer polls a socket it closes from elsewhere, so its
+					// poll is stopped already
+					reg->closed.push_back(s);
+					reg->has_closed.store(true, std::memory_order_release);
+				}
+			}
+		}
+#ifdef _WIN32
+		auto ret = closesocket(s);
+#else
+		auto ret = close(s);
+#endif
+		reg->release();
+		return ret;
+	}
+};
+
+// Counters and histograms behind IMultiStats. Written on the loop thread with
+// relaxed atomics, read from any thread
+struct multi_stats{
+	typedef std::array<std::atomic<std::uint64_t>, Histogram::Buckets> histogram;
+	enum{ max_hosts = 64 };
+
+	std::array<std::atomic<std::uint64_t>, MultiCounter::Count> counters;
+	std::array<histogram, StatusClass::Count> latency;
+	histogram socket_action;
+	std::array<histogram, max_hosts> host_latency;
+	// Each name is published once and lives as long as the stats
+	std::array<std::atomic<const std::string*>, max_hosts> host_names;
+	std::atomic<std::uint32_t> host_count;
+	std::atomic<std::int64_t> reset_at;
+	// Only used on the loop thread
+	std::unordered_map<std::string, std::uint32_t> host_slots;
+
+	static std::int64_t now(){
+		return std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static void clear(histogram& h){
+		for (auto& b : h){
+			b.store(0, std::memory_order_relaxed);
+		}
+	}
+	static std::vector<std::uint64_t> read(const histogram& h){
+		std::vector<std::uint64_t> ret(h.size());
+		for (std::size_t i = 0; i < h.size(); ++i){
+			ret[i] = h[i].load(std::memory_order_relaxed);
+		}
+		return ret;
+	}
+	static void record(histogram& h, std::uint64_t micros){
+		h[Histogram::BucketIndex(micros)].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	multi_stats() :host_count{ 0 }, reset_at{ now() }{
+		for (auto& c : counters){
+			c.store(0, std::memory_order_relaxed);
+		}
+		for (auto& n : host_names){
+			n.store(nullptr, std::memory_order_relaxed);
+		}
+		Reset();
+	}
+	~multi_stats(){
+		for (auto& n : host_names){
+			delete n.load(std::memory_order_relaxed);
+		}
+	}
+
+	void add(std::int32_t counter, std::uint64_t n = 1){
+		counters[counter].fetch_add(n, std::memory_order_relaxed);
+	}
+	void sub(std::int32_t counter, std::uint64_t n = 1){
+		counters[counter].fetch_sub(n, std::memory_order_relaxed);
+	}
+
+	// Runs on the loop thread
+	std::uint32_t host_slot(const std::string& host){
+		auto iter = host_slots.find(host);
+		if (iter != host_slots.end()){
+			return iter->second;
+		}
+		auto count = host_count.load(std::memory_order_relaxed);
+		if (count < max_hosts - 1){
+			host_names[count].store(new std::string{ host }, std::memory_order_release);
+			host_count.store(count + 1, std::memory_order_release);
+			host_slots[host] = count;
+			return count;
+		}
+		if (count == max_hosts - 1){
+			host_names[count].store(new std::string{ "*" }, std::memory_order_release);
+			host_count.store(max_hosts, std::memory_order_release);
+		}
+		return max_hosts - 1;
+	}
+
+	void Reset(){
+		for (auto i = static_cast<int>(MultiCounter::Added); i < MultiCounter::Count; ++i){
+			counters[i].store(0, std::memory_order_relaxed);
+		}
+		for (auto& h : latency){
+			clear(h);
+		}
+		clear(socket_action);
+		for (auto& h : host_latency){
+			clear(h);
+		}
+		reset_at.store(now(), std::memory_order_relaxed);
+	}
+};
+
+struct ImpMulti :implement_runtime_class<ImpMulti, Multi_t>
+{
+	bool own_executor_;
+	use<uv::IUvExecutor> executor_;
+	std::thread thread_;
+
+	CURLM* multi_;
+
+	use<uv::ITimer> timeout_;
+	// Timers started by After, only accessed on the loop thread
+	std::unordered_map<std::uint64_t, use<uv::ITimer>> timers_;
+	std::uint64_t next_timer_;
+
+	// Only accessed on the loop thread
+	use<IShare> share_;
+
+	// Poll handle per socket, shut down after curl_multi_cleanup has closed the
+	// cached connections
+	socket_registry* sockets_;
+
+	// Adds and removes from other threads go through a lock-free
+	// multi-producer stack that the loop thread drains in one closure.
+	// Only the producer that finds no drain scheduled wakes the loop
+	struct submission{
+		enum { add, start, remove } kind;
+		use<IEasy> easy;
+		use<Callbacks::CompletedFunction> func;
+		decltype(make_promise<void>()) promise;
+		submission* next;
+		// Whichever of the drain and a Submit that could not wake the loop
+		// claims it first decides whether it runs
+		enum { queued, taken, withdrawn };
+		std::atomic<int> state;
+
+		submission() :next{ nullptr }, state{ queued }{}
+
+		bool claim(int to){
+			int expected = queued;
+			return state.compare_exchange_strong(expected, to);
+		}
+	};
+	std::atomic<submission*> submissions_;
+	std::atomic<bool> drain_scheduled_;
+
+	// Queue depth and drain batch counters
+	std::atomic<std::int64_t> submit_depth_;
+	std::atomic<std::int64_t> submit_depth_high_;
+	std::atomic<std::uint64_t> drains_;
+	std::atomic<std::uint64_t> drained_;
+	std::atomic<std::uint64_t> drain_batch_high_;
+
+	// Scheduler in front of curl_multi_add_handle, only accessed on the loop
+	// thread
+	struct waiting_transfer{
+		use<IEasy> easy;
+		use<Callbacks::CompletedFunction> func;
+	};
+	cppcomponents_libcurl_libuv::detail::transfer_scheduler<waiting_transfer, TransferPriority::Count> scheduler_;
+	bool dispatching_;
+
+	std::unique_ptr<multi_stats> stats_;
+
+	static void update_high(std::atomic<std::int64_t>& high, std::int64_t value){
+		auto cur = high.load(std::memory_order_relaxed);
+		while (value > cur && !high.compare_exchange_weak(cur, value, std::memory_order_relaxed)){}
+	}
+	static void update_high(std::atomic<std::uint64_t>& high, std::uint64_t value){
+		auto cur = high.load(std::memory_order_relaxed);
+		while (value > cur && !high.compare_exchange_weak(cur, value, std::memory_order_relaxed)){}
+	}
+
+	static void curl_perform(use<uv::IPoll>, int status, int events, curl_socket_t sockfd, ImpMulti* pthis)
+	{
+		int running_handles;
 		int flags = 0;
-		char *done_url;
-		CURLMsg *message;
-		int pending;
 		pthis->timeout_.Stop();
 
 		if (events & uv::Constants::PollEvent::Readable)
@@ -553,21 +1559,63 @@ struct ImpMulti :implement_runtime_class<ImpMulti, Multi_t>
 
 
 
+		auto start = multi_stats::now();
 		curl_multi_socket_action(pthis->multi_, sockfd, flags,
 			&running_handles);
+		pthis->RecordSocketAction(start);
+
+		pthis->ProcessMessages();
+	}
+
+	void RecordSocketAction(std::int64_t start){
+		auto micros = multi_stats::now() - start;
+		stats_->add(MultiCounter::SocketActions);
+		stats_->add(MultiCounter::SocketActionMicros, micros);
+		multi_stats::record(stats_->socket_action, micros);
+	}
+
+	// Runs on the loop thread after the handle was removed and its timings read.
+	// A cancelled transfer only counts towards the bytes, its latency would say
+	// when it was removed rather than how long it took
+	void RecordCompletion(ImpEasy& imp, CURLcode code, bool cancelled){
+		auto& t = imp.timings_;
+		stats_->add(MultiCounter::BytesDownloaded, static_cast<std::uint64_t>(t[TimingValue::BytesDownloaded]));
+		stats_->add(MultiCounter::BytesUploaded, static_cast<std::uint64_t>(t[TimingValue::BytesUploaded]));
+		if (cancelled){
+			stats_->add(MultiCounter::Cancelled);
+			return;
+		}
+		std::int32_t status_class = StatusClass::Failed;
+		if (code == CURLE_OK){
+			long response_code = 0;
+			curl_easy_getinfo(imp.easy_, CURLINFO_RESPONSE_CODE, &response_code);
+			status_class = static_cast<std::int32_t>(response_code / 100);
+			if (status_class < 0 || status_class >= StatusClass::Count){
+				status_class = StatusClass::Failed;
+			}
+			stats_->add(MultiCounter::Completed);
+		}
+		else{
+			stats_->add(MultiCounter::Failed);
+		}
+		auto micros = static_cast<std::uint64_t>((t[TimingValue::QueueWait] + t[TimingValue::Total]) * 1e6);
+		multi_stats::record(stats_->latency[status_class], micros);
+		multi_stats::record(stats_->host_latency[stats_->host_slot(imp.host_)], micros);
+	}
 
-		while ((message = curl_multi_info_read(pthis->multi_, &pending))) {
+	// Completes finished transfers, then starts waiting ones in the room they left
+	void ProcessMessages(){
+		CURLMsg *message;
+		int pending;
+		std::uint64_t count = 0;
+		while ((message = curl_multi_info_read(multi_, &pending))) {
+			++count;
 
 
 			switch (message->msg) {
 			case CURLMSG_DONE:
 			{
-								 curl_easy_getinfo(message->easy_handle, CURLINFO_EFFECTIVE_URL,
-									 &done_url);
-								 auto easy = message->easy_handle;
-								 auto ieasy = ieasy_from_easy(easy);
-
-								 pthis->RemoveAndCallCallback(ieasy, message->data.result);
+								 RemoveAndCallCallback(*ImpEasy::impeasy_from_easy(message->easy_handle), message->data.result, false);
 
 			}
 
@@ -577,6 +1625,11 @@ struct ImpMulti :implement_runtime_class<ImpMulti, Multi_t>
 				abort();
 			}
 		}
+		if (count){
+			stats_->add(MultiCounter::InfoReadDrains);
+			stats_->add(MultiCounter::InfoReadMessages, count);
+		}
+		Dispatch();
 	}
 
 
@@ -589,37 +1642,22 @@ struct ImpMulti :implement_runtime_class<ImpMulti, Multi_t>
 			auto& timeout = pthis->timeout_;
             if (timeout_ms <= 0){
                 int running_handles;
+                auto start = multi_stats::now();
                 curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0,
                     &running_handles);
-                int pending = 0;
-                CURLMsg * message = nullptr;
-                while ((message = curl_multi_info_read(pthis->multi_, &pending))) {
-
-
-                    switch (message->msg) {
-                    case CURLMSG_DONE:
-                    {
-
-                                         auto easy = message->easy_handle;
-                                         auto ieasy = ieasy_from_easy(easy);
-
-                                         pthis->RemoveAndCallCallback(ieasy, message->data.result);
-
-                    }
-
-                        break;
-                    default:
-                        fprintf(stderr, "CURLMSG default\n");
-                        abort();
-                    }
-                }
+                pthis->RecordSocketAction(start);
+                pthis->ProcessMessages();
                 return;
             }
 
-			timeout.Start([multi](use<uv::ITimer>, int status){
+			timeout.Start([multi, pthis](use<uv::ITimer>, int status){
 				int running_handles;
+				auto start = multi_stats::now();
 				curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0,
 					&running_handles);
+				pthis->RecordSocketAction(start);
+				// Transfers can also finish on a timeout
+				pthis->ProcessMessages();
 			}, std::chrono::milliseconds{ timeout_ms });
 		}
 		catch (...){
@@ -631,41 +1669,42 @@ struct ImpMulti :implement_runtime_class<ImpMulti, Multi_t>
 	}
 
 	static int handle_socket(CURL *easy, curl_socket_t s, int action, void *userp,
-		void *)
+		void *socketp)
 	{
 		try{
 
 
 			auto pthis = static_cast<ImpMulti*>(userp);
-			auto ieasy = ieasy_from_easy(easy);
-			auto iunkpoll = ieasy.GetPrivate(&pollid);
-			use<uv::IPoll> poll;
+			auto ppoll = static_cast<use<uv::IPoll>*>(socketp);
 		
-			if (action == CURL_POLL_IN || action == CURL_POLL_OUT) {
-				if (!iunkpoll) {
-					poll = uv::Poll{ pthis->executor_.GetLoop(), s, false };
-					ieasy.StorePrivate(&pollid, poll);
-				}
-				else{
-					poll = iunkpoll.QueryInterface<uv::IPoll>();
-
+			if (!ppoll && action != CURL_POLL_REMOVE) {
+				pthis->sockets_->drop_closed();
+				ppoll = &pthis->sockets_->polls[s];
+				if (!*ppoll) {
+					*ppoll = uv::Poll{ pthis->executor_.GetLoop(), s, false };
 				}
+				auto res = curl_multi_assign(pthis->multi_, s, ppoll);
+				curl_throw_if_error(res);
 			}
 
+			using namespace std::placeholders;
 			switch (action) {
 			case CURL_POLL_IN:
-				using namespace std::placeholders;
-				poll.Start(uv::Constants::PollEvent::Readable, std::bind(curl_perform, _1, _2, _3, s,pthis));
+				ppoll->Start(uv::Constants::PollEvent::Readable, std::bind(curl_perform, _1, _2, _3, s,pthis));
 				break;
 			case CURL_POLL_OUT:
-				poll.Start(uv::Constants::PollEvent::Writable, std::bind(curl_perform, _1, _2, _3, s,pthis));
+				ppoll->Start(uv::Constants::PollEvent::Writable, std::bind(curl_perform, _1, _2, _3, s,pthis));
 
 
+				break;
+			case CURL_POLL_INOUT:
+				ppoll->Start(uv::Constants::PollEvent::Readable | uv::Constants::PollEvent::Writable,
+					std::bind(curl_perform, _1, _2, _3, s, pthis));
 				break;
 			case CURL_POLL_REMOVE:
-				if (poll) {
-					poll.Stop();
-					ieasy.RemovePrivate(&pollid);
+				// The poll stays in the registry until the socket is closed
+				if (ppoll) {
+					ppoll->Stop();
 				}
 				break;
 			default:
@@ -691,11 +1730,18 @@ struct ImpMulti :implement_runtime_class<ImpMulti, Multi_t>
 		curl_multi_setopt(multi_, CURLMOPT_TIMERFUNCTION, start_timeout);
 		curl_multi_setopt(multi_, CURLMOPT_TIMERDATA, static_cast<void*>(this));
 		timeout_ = uv::Timer{ executor_.GetLoop() };
+		std::unique_lock<std::mutex> lock{ sockets_->mut };
+		sockets_->loop_thread = std::this_thread::get_id();
 	}
 
 	ImpMulti(use<InterfaceUnknown> executor = nullptr) 
 		:own_executor_{!executor},
-		executor_{ own_executor_ ? uv::Executor{} : executor.QueryInterface<uv::IUvExecutor>() }
+		executor_{ own_executor_ ? uv::Executor{} : executor.QueryInterface<uv::IUvExecutor>() },
+		next_timer_{ 0 },
+		sockets_{ new socket_registry }, submissions_{ nullptr }, drain_scheduled_{ false }, submit_depth_{ 0 }, submit_depth_high_{ 0 },
+		drains_{ 0 }, drained_{ 0 }, drain_batch_high_{ 0 },
+		dispatching_{ false },
+		stats_{ new multi_stats }
 	{
 		use<IMulti> self = QueryInterface<IMulti>();
 		executor_.Add([this,self]()mutable{
@@ -716,11 +1762,13 @@ struct ImpMulti :implement_runtime_class<ImpMulti, Multi_t>
 	}
 	void ReleaseImplementationDestroy(){
 		auto multi = multi_;
+		auto sockets = sockets_;
 		timeout_ = nullptr;
 		auto exec = executor_;
 		executor_ = nullptr;
-		exec.Add([multi,exec]()mutable{
+		exec.Add([multi,sockets,exec]()mutable{
 			curl_multi_cleanup(multi);
+			sockets->shutdown();
 			multi = nullptr;
 			exec.MakeLoopExit();
 			exec = nullptr;
@@ -733,74 +1781,524 @@ struct ImpMulti :implement_runtime_class<ImpMulti, Multi_t>
 			exec.RunQueuedClosures();
 		}
 		exec = nullptr;
+		if (share_){
+			ImpShare::from_ishare(share_).Detach(this);
+		}
 		delete this;
 	}
 	~ImpMulti(){
+		// Every drain holds a reference, so anything left was never scheduled
+		auto head = submissions_.exchange(nullptr);
+		while (head){
+			std::unique_ptr<submission> s{ head };
+			head = head->next;
+		}
+	}
+
+	static void ClearSlots(ImpEasy& imp){
+		imp.completed_ = nullptr;
+		imp.multi_ = nullptr;
+		imp.running_in_.store(nullptr, std::memory_order_release);
+	}
+
+	// Runs on the loop thread
+	void AddToMulti(use<IEasy>& easy, use<Callbacks::CompletedFunction>& func, use<IMulti>& self){
+		if (share_){
+			easy.SetPointerOption(CURLOPT_SHARE, share_.get_portable_base());
+		}
+		auto& imp = ImpEasy::from_ieasy(easy);
+		imp.completed_ = func;
+		imp.multi_ = self;
+		imp.transfer_.fetch_add(1, std::memory_order_acq_rel);
+		imp.running_in_.store(this, std::memory_order_release);
+		// Connections made for this transfer tell us when their socket closes
+		curl_easy_setopt(imp.easy_, CURLOPT_OPENSOCKETFUNCTION, socket_registry::open_socket);
+		curl_easy_setopt(imp.easy_, CURLOPT_OPENSOCKETDATA, static_cast<void*>(sockets_));
+		curl_easy_setopt(imp.easy_, CURLOPT_CLOSESOCKETFUNCTION, socket_registry::close_socket);
+		curl_easy_setopt(imp.easy_, CURLOPT_CLOSESOCKETDATA, static_cast<void*>(sockets_));
+		// libcurl may run the timer callback, and with it completions, from
+		// inside curl_multi_add_handle. Dispatch waits for the outer call
+		auto dispatching = dispatching_;
+		dispatching_ = true;
+		auto res = curl_multi_add_handle(multi_, imp.easy_);
+		dispatching_ = dispatching;
+		curl_throw_if_error(res);
+		imp.queue_wait_ = std::chrono::steady_clock::now() - imp.queued_at_;
+		scheduler_.started(imp.host_);
+		stats_->add(MultiCounter::Added);
+		stats_->add(MultiCounter::Running);
+	}
+
+	// Runs on the loop thread. Starts the transfer now if the limits allow and
+	// nothing is waiting, otherwise queues it. Throws if it could not be started
+	void Schedule(use<IEasy>& easy, use<Callbacks::CompletedFunction>& func, use<IMulti>& self){
+		auto& imp = ImpEasy::from_ieasy(easy);
+		imp.host_ = host_from_url(imp.url_);
+		if (scheduler_.can_start(imp.host_)){
+			AddToMulti(easy, func, self);
+			return;
+		}
+		waiting_transfer w = { easy, func };
+		scheduler_.push(imp.host_, imp.priority_, std::move(w));
+		stats_->add(MultiCounter::Waiting);
+		imp.waiting_ = true;
+	}
+
+	// Starts waiting transfers while there is room, the higher priority classes
+	// first and hosts in turn within a class
+	void Dispatch(){
+		if (dispatching_ || scheduler_.waiting() == 0){
+			return;
+		}
+		// Completions while starting a transfer run in here again
+		dispatching_ = true;
+		use<IMulti> self = QueryInterface<IMulti>();
+		for (;;){
+			waiting_transfer w;
+			std::string host;
+			if (!scheduler_.next(w, host)){
+				break;
+			}
+			stats_->sub(MultiCounter::Waiting);
+			auto& imp = ImpEasy::from_ieasy(w.easy);
+			imp.waiting_ = false;
+			try{
+				AddToMulti(w.easy, w.func, self);
+			}
+			catch (...){
+				ClearSlots(imp);
+				scheduler_.release(host);
+				try{
+					// Add already succeeded, so report this through the callback
+					CallCallback(imp, w.easy, w.func, CURLE_FAILED_INIT);
+				}
+				catch (...){
+					// swallow exceptions
+				}
+			}
+		}
+		dispatching_ = false;
+	}
+
+	// Runs on the loop thread, the transfer is no longer in the multi
+	void Finished(ImpEasy& imp){
+		stats_->sub(MultiCounter::Running);
+		scheduler_.finished(imp.host_);
+	}
+
+	// Takes a transfer that has not started out of its queue
+	void RemoveWaiting(ImpEasy& imp, use<IEasy>& easy){
+		waiting_transfer w;
+		auto found = scheduler_.remove(imp.host_, [&imp](const waiting_transfer& t){
+			return &ImpEasy::from_ieasy(t.easy) == &imp;
+		}, w);
+		if (!found){
+			throw error_fail();
+		}
+		stats_->sub(MultiCounter::Waiting);
+		imp.waiting_ = false;
+		CallCallback(imp, easy, w.func, CURLE_OK);
 	}
 
-	void RemovePrivate(cppcomponents::use<IEasy>& easy){
-			easy.RemovePrivate(&callbackid);
-			easy.RemovePrivate(&pollid);
-			easy.RemovePrivate(&selfid);
+	// Pushes s for the loop thread. If the loop cannot be woken, s is withdrawn
+	// and the error thrown, unless a drain already took it, which runs it
+	void Submit(submission* s){
+		auto head = submissions_.load(std::memory_order_relaxed);
+		do{
+			s->next = head;
+		} while (!submissions_.compare_exchange_weak(head, s));
+		update_high(submit_depth_high_, ++submit_depth_);
+
+		if (!drain_scheduled_.exchange(true)){
+			use<IMulti> self = QueryInterface<IMulti>();
+			try{
+				executor_.Add([this, self]()mutable{
+					DrainSubmissions();
+				});
+			}
+			catch (...){
+				drain_scheduled_.store(false);
+				// Left on the stack for the next drain to free
+				if (s->claim(submission::withdrawn)){
+					throw;
+				}
+			}
+		}
+	}
+
+	// Runs on the loop thread
+	void DrainSubmissions(){
+		// Clear the flag before taking the stack so a producer that pushes
+		// after the exchange schedules another drain
+		drain_scheduled_.store(false);
+		auto head = submissions_.exchange(nullptr);
+
+		// Restore submission order
+		submission* fifo = nullptr;
+		std::uint64_t count = 0;
+		while (head){
+			auto next = head->next;
+			head->next = fifo;
+			fifo = head;
+			head = next;
+			++count;
+		}
+		if (!count){
+			return;
+		}
+		submit_depth_ -= static_cast<std::int64_t>(count);
+		++drains_;
+		drained_ += count;
+		update_high(drain_batch_high_, count);
+
+		use<IMulti> self = QueryInterface<IMulti>();
+		while (fifo){
+			std::unique_ptr<submission> s{ fifo };
+			fifo = fifo->next;
+			if (!s->claim(submission::taken)){
+				// Its Submit failed and told the caller
+				continue;
+			}
+			if (s->kind == submission::add){
+				try{
+					Schedule(s->easy, s->func, self);
+					s->promise.Set();
+				}
+				catch (...){
+					ClearSlots(ImpEasy::from_ieasy(s->easy));
+					s->promise.SetError(error_fail::ec);
+				}
+			}
+			else if (s->kind == submission::start){
+				try{
+					Schedule(s->easy, s->func, self);
+				}
+				catch (...){
+					auto& imp = ImpEasy::from_ieasy(s->easy);
+					ClearSlots(imp);
+					try{
+						CallCallback(imp, s->easy, s->func, CURLE_FAILED_INIT);
+					}
+					catch (...){
+						// swallow exceptions
+					}
+				}
+			}
+			else{
+				try{
+					auto& imp = ImpEasy::from_ieasy(s->easy);
+					if (imp.waiting_){
+						RemoveWaiting(imp, s->easy);
+					}
+					else if (!imp.completed_){
+						// Already completed, and a pool may have handed it out since
+						throw error_fail();
+					}
+					else{
+						RemoveAndCallCallback(imp, CURLE_OK, true);
+					}
+					s->promise.Set();
+				}
+				catch (std::exception& e){
+					s->promise.SetError(error_mapper::error_code_from_exception(e));
+				}
+			}
+		}
+		Dispatch();
 	}
 
 	Future<void> Add(cppcomponents::use<IEasy> easy, cppcomponents::use<Callbacks::CompletedFunction> func){
+		ImpEasy::from_ieasy(easy).queued_at_ = std::chrono::steady_clock::now();
+		std::unique_ptr<submission> s{ new submission };
+		s->kind = submission::add;
+		s->easy = easy;
+		s->func = func;
+		s->promise = make_promise<void>();
+		auto future = s->promise.QueryInterface<IFuture<void>>();
+		// The stack owns the submission once pushed
+		Submit(s.release());
+		return future;
+
+	}
+	Future<void> After(std::uint32_t milliseconds){
 		auto promise = make_promise<void>();
 		use<IMulti> self = QueryInterface<IMulti>();
-		auto closure = [self,promise,this, easy, func]()mutable{
-			// Store the promise
+		executor_.Add([this, self, promise, milliseconds]()mutable{
+			auto id = next_timer_++;
 			try{
+				use<uv::ITimer> timer = uv::Timer{ executor_.GetLoop() };
+				timers_[id] = timer;
+				// The timer holds self until it fires
+				timer.Start([this, self, promise, id](use<uv::ITimer>, int)mutable{
+					// Erasing the timer destroys this callback, so what is used
+					// after it is moved out first
+					auto p = std::move(promise);
+					auto keep = std::move(self);
+					timers_.erase(id);
+					p.Set();
+				}, std::chrono::milliseconds{ milliseconds });
+			}
+			catch (std::exception& e){
+				timers_.erase(id);
+				promise.SetError(error_mapper::error_code_from_exception(e));
+			}
+		});
+		return promise.QueryInterface<IFuture<void>>();
+	}
 
-				easy.StorePrivate(&callbackid, func);
-				easy.StorePrivate(&selfid, self);
-				auto res = curl_multi_add_handle(multi_, static_cast<CURL*>(easy.GetNative()));
-				curl_throw_if_error(res);
-				promise.Set();
+	void Start(cppcomponents::use<IEasy> easy, cppcomponents::use<Callbacks::CompletedFunction> func){
+		ImpEasy::from_ieasy(easy).queued_at_ = std::chrono::steady_clock::now();
+		std::unique_ptr<submission> s{ new submission };
+		s->kind = submission::start;
+		s->easy = easy;
+		s->func = func;
+		try{
+			Submit(s.release());
+		}
+		catch (...){
+			// The loop never sees it, so it completes here
+			try{
+				CallCallback(ImpEasy::from_ieasy(easy), easy, func, CURLE_FAILED_INIT);
 			}
 			catch (...){
-				RemovePrivate(easy);
-
-				promise.SetError(error_fail::ec);
+				// swallow exceptions
+			}
+		}
+	}
+	Future<void> AddMany(std::vector<use<IEasy>> easies, std::vector<use<Callbacks::CompletedFunction>> funcs){
+		if (easies.size() != funcs.size()){
+			throw error_invalid_arg();
+		}
+		auto now = std::chrono::steady_clock::now();
+		for (auto& e : easies){
+			ImpEasy::from_ieasy(e).queued_at_ = now;
+		}
+		auto promise = make_promise<void>();
+		use<IMulti> self = QueryInterface<IMulti>();
+		auto closure = [self, promise, this, easies, funcs]()mutable{
+			for (std::size_t i = 0; i < easies.size(); ++i){
+				try{
+					Schedule(easies[i], funcs[i], self);
+				}
+				catch (...){
+					auto& imp = ImpEasy::from_ieasy(easies[i]);
+					ClearSlots(imp);
+					try{
+						// The others were added, so report this one through its own callback
+						CallCallback(imp, easies[i], funcs[i], CURLE_FAILED_INIT);
+					}
+					catch (...){
+						// swallow exceptions
+					}
+				}
 			}
+			Dispatch();
+			promise.Set();
 		};
 
 		executor_.Add(closure);
 
 		return promise.QueryInterface<IFuture<void>>();
-
 	}
-	template<class I>
-	use<I> GetPrivateSafe(use<IEasy>& easy, const void* key){
-		auto iunk = easy.GetPrivate(key);
-		if (!iunk){
+
+	// cancelled is set when Remove took the transfer out before it finished
+	void RemoveAndCallCallback(ImpEasy& imp, CURLcode code, bool cancelled){
+		auto res = curl_multi_remove_handle(multi_, imp.easy_);
+		curl_throw_if_error(res);
+		Finished(imp);
+		imp.ReadTimings(imp.timings_, code == CURLE_OK && !cancelled);
+		RecordCompletion(imp, code, cancelled);
+		auto func = imp.completed_;
+		if (!func){
 			throw error_fail();
 		}
-		return iunk.QueryInterface<I>();
+		ClearSlots(imp);
+		auto easy = imp.QueryInterface<IEasy>();
+		CallCallback(imp, easy, func, code);
+
 	}
-	void RemoveAndCallCallback(use<IEasy> easy, CURLcode code){
-		auto res = curl_multi_remove_handle(multi_, static_cast<CURL*>(easy.GetNative()));
-		curl_throw_if_error(res);
-		auto func = GetPrivateSafe<Callbacks::CompletedFunction>(easy, &callbackid);
-		RemovePrivate(easy);
+	void CallCallback(ImpEasy& imp, use<IEasy>& easy, use<Callbacks::CompletedFunction>& func, CURLcode code){
+		auto pool = imp.pool_;
 		func(easy, code);
-
+		if (pool){
+			pool.Release(easy);
+		}
 	}
 	Future<void> Remove(cppcomponents::use<IEasy> easy){
+		std::unique_ptr<submission> s{ new submission };
+		s->kind = submission::remove;
+		s->easy = easy;
+		s->promise = make_promise<void>();
+		auto future = s->promise.QueryInterface<IFuture<void>>();
+		// The stack owns the submission once pushed
+		Submit(s.release());
+		return future;
+	}
+	void* GetNative(){
+		return multi_;
+	}
+
+	void SetShare(cppcomponents::use<IShare> share){
+		// Fails on the caller's thread if the share already belongs to another multi
+		if (share){
+			ImpShare::from_ishare(share).Attach(this);
+		}
+		use<IMulti> self = QueryInterface<IMulti>();
+		executor_.Add([this, self, share]()mutable{
+			if (share_ && share_.get_portable_base() != share.get_portable_base()){
+				ImpShare::from_ishare(share_).Detach(this);
+			}
+			share_ = share;
+		});
+	}
+
+	Future<void> SetInt32Option(std::int32_t option, std::int32_t parameter){
+		if (option == SchedulerOptions::MaxActive || option == SchedulerOptions::MaxActivePerHost){
+			if (parameter < 0){
+				throw error_invalid_arg();
+			}
+			auto promise = make_promise<void>();
+			use<IMulti> self = QueryInterface<IMulti>();
+			executor_.Add([this, self, promise, option, parameter]()mutable{
+				if (option == SchedulerOptions::MaxActive){
+					scheduler_.set_max_active(parameter);
+				}
+				else{
+					scheduler_.set_max_active_per_host(parameter);
+				}
+				// The limits may have gone up
+				Dispatch();
+				promise.Set();
+			});
+			return promise.QueryInterface<IFuture<void>>();
+		}
+		// The socket and timer options belong to Multi
+		if (option < 0 || option >= CURLOPTTYPE_OBJECTPOINT){
+			throw error_invalid_arg();
+		}
+#if LIBCURL_VERSION_NUM < 0x072b00
+		// Older libcurl would take CURLPIPE_MULTIPLEX as HTTP/1.1 pipelining
+		if (option == CURLMOPT_PIPELINING && (parameter & ~1)){
+			throw error_invalid_arg();
+		}
+#endif
 		auto promise = make_promise<void>();
-		auto closure = [promise, this, easy]()mutable{
+		use<IMulti> self = QueryInterface<IMulti>();
+		executor_.Add([this, self, promise, option, parameter]()mutable{
+			auto res = curl_multi_setopt(multi_, static_cast<CURLMoption>(option), static_cast<long>(parameter));
+			if (res != CURLM_OK){
+				promise.SetError(-static_cast<error_code>(res));
+			}
+			else{
+				promise.Set();
+			}
+		});
+		return promise.QueryInterface<IFuture<void>>();
+	}
 
-			RemoveAndCallCallback(easy, CURLE_OK);
-		};
-		executor_.Add(closure);
+	Future<void> Pause(cppcomponents::use<IEasy> easy, std::int32_t bitmask){
+		return PauseOnLoop(easy, false, 0, bitmask);
+	}
+	Future<void> PauseTransfer(cppcomponents::use<IEasy> easy, std::uint64_t transfer, std::int32_t bitmask){
+		return PauseOnLoop(easy, true, transfer, bitmask);
+	}
 
+	// Pauses easy if its transfer is still running in this multi, and if
+	// match_transfer is set, is transfer. A stale PauseTransfer does nothing
+	Future<void> PauseOnLoop(use<IEasy> easy, bool match_transfer, std::uint64_t transfer, std::int32_t bitmask){
+		auto promise = make_promise<void>();
+		use<IMulti> self = QueryInterface<IMulti>();
+		executor_.Add([this, self, promise, easy, match_transfer, transfer, bitmask]()mutable{
+			try{
+				auto& imp = ImpEasy::from_ieasy(easy);
+				// The handle may have completed before this ran, and a pool may
+				// have handed it to a transfer on another multi since. Only this
+				// loop thread sets running_in_ to this, so once it matches the
+				// rest of imp is ours to read
+				bool ours = imp.running_in_.load(std::memory_order_acquire) == this
+					&& (!match_transfer || imp.transfer_.load(std::memory_order_acquire) == transfer);
+				if (!ours){
+					if (match_transfer){
+						promise.Set();
+						return;
+					}
+					throw error_invalid_arg();
+				}
+				if (!imp.completed_){
+					throw error_invalid_arg();
+				}
+				auto res = curl_easy_pause(imp.easy_, bitmask);
+				curl_throw_if_error(res);
+				promise.Set();
+			}
+			catch (std::exception& e){
+				promise.SetError(error_mapper::error_code_from_exception(e));
+			}
+		});
 		return promise.QueryInterface<IFuture<void>>();
 	}
-	void* GetNative(){
-		return multi_;
+
+	std::vector<std::uint64_t> Counters(){
+		std::vector<std::uint64_t> ret(MultiCounter::Count);
+		for (std::size_t i = 0; i < ret.size(); ++i){
+			ret[i] = stats_->counters[i].load(std::memory_order_relaxed);
+		}
+		auto depth = submit_depth_.load(std::memory_order_relaxed);
+		ret[MultiCounter::SubmitDepth] = depth > 0 ? depth : 0;
+		ret[MultiCounter::SubmitDepthHigh] = submit_depth_high_.load(std::memory_order_relaxed);
+		ret[MultiCounter::Drains] = drains_.load(std::memory_order_relaxed);
+		ret[MultiCounter::Drained] = drained_.load(std::memory_order_relaxed);
+		ret[MultiCounter::DrainBatchHigh] = drain_batch_high_.load(std::memory_order_relaxed);
+		ret[MultiCounter::MicrosSinceReset] = multi_stats::now() - stats_->reset_at.load(std::memory_order_relaxed);
+		return ret;
+	}
+
+	std::vector<std::uint64_t> LatencyHistogram(std::int32_t status_class){
+		if (status_class < 0 || status_class >= StatusClass::Count){
+			throw error_invalid_arg();
+		}
+		return multi_stats::read(stats_->latency[status_class]);
+	}
+
+	std::vector<std::uint64_t> SocketActionHistogram(){
+		return multi_stats::read(stats_->socket_action);
 	}
 
+	std::uint32_t HostCount(){
+		return stats_->host_count.load(std::memory_order_acquire);
+	}
+	std::string HostName(std::uint32_t index){
+		if (index >= HostCount()){
+			throw error_invalid_arg();
+		}
+		return *stats_->host_names[index].load(std::memory_order_acquire);
+	}
+	std::vector<std::uint64_t> HostLatencyHistogram(std::uint32_t index){
+		if (index >= HostCount()){
+			throw error_invalid_arg();
+		}
+		return multi_stats::read(stats_->host_latency[index]);
+	}
 
+	std::uint64_t HostPercentile(cppcomponents::cr_string url, double q){
+		auto host = host_from_url(url.to_string());
+		auto count = HostCount();
+		for (std::uint32_t i = 0; i < count; ++i){
+			if (*stats_->host_names[i].load(std::memory_order_acquire) == host){
+				return Histogram::Percentile(multi_stats::read(stats_->host_latency[i]), q);
+			}
+		}
+		return 0;
+	}
 
+	// Gauges are left alone
+	void Reset(){
+		stats_->Reset();
+		submit_depth_high_.store(0, std::memory_order_relaxed);
+		drains_.store(0, std::memory_order_relaxed);
+		drained_.store(0, std::memory_order_relaxed);
+		drain_batch_high_.store(0, std::memory_order_relaxed);
+	}
 
 	void* IImp_GetImp(){
 		return this;
@@ -810,6 +2308,227 @@ struct ImpMulti :implement_runtime_class<ImpMulti, Multi_t>
 
 CPPCOMPONENTS_REGISTER(ImpMulti)
 
+struct ImpMultiGroup :implement_runtime_class<ImpMultiGroup, MultiGroup_t>
+{
+	std::int32_t policy_;
+	std::vector<use<IMulti>> multis_;
+	// multis_[i] queried for IMulti2 once
+	std::vector<use<IMulti2>> multis2_;
+	std::unique_ptr<std::atomic<std::int32_t>[]> outstanding_;
+
+	std::size_t Choose(use<IEasy>& easy){
+		if (policy_ == MultiGroupPolicy::HostAffinity){
+			return std::hash<std::string>()(host_from_url(ImpEasy::from_ieasy(easy).url_)) % multis_.size();
+		}
+		std::size_t best = 0;
+		for (std::size_t i = 1; i < multis_.size(); ++i){
+			if (outstanding_[i].load(std::memory_order_relaxed) < outstanding_[best].load(std::memory_order_relaxed)){
+				best = i;
+			}
+		}
+		return best;
+	}
+
+	ImpMultiGroup(std::uint32_t threads, std::int32_t policy) :policy_{ policy }{
+		if (policy != MultiGroupPolicy::LeastOutstanding && policy != MultiGroupPolicy::HostAffinity){
+			throw error_invalid_arg();
+		}
+		if (threads == 0){
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		}
+		outstanding_.reset(new std::atomic<std::int32_t>[threads]);
+		for (std::uint32_t i = 0; i < threads; ++i){
+			outstanding_[i].store(0);
+			// Each Multi owns a loop thread
+			Multi m;
+			multis_.push_back(m.QueryInterface<IMulti>());
+			multis2_.push_back(m.QueryInterface<IMulti2>());
+		}
+	}
+
+	// Counts easy as outstanding on multis_[index] until func is called
+	use<Callbacks::CompletedFunction> Track(std::size_t index, use<IEasy>& easy, use<Callbacks::CompletedFunction>& func){
+		auto pcount = &outstanding_[index];
+		use<IMulti> self = QueryInterface<IMulti>();
+
+		auto& imp = ImpEasy::from_ieasy(easy);
+		imp.group_multi_.store(multis_[index].get_portable_base(), std::memory_order_release);
+		++*pcount;
+		auto pimp = &imp;
+		auto completed = [self, pcount, pimp, func](use<IEasy> e, std::int32_t ec)mutable{
+			--*pcount;
+			pimp->group_multi_.store(nullptr, std::memory_order_release);
+			func(e, ec);
+		};
+		return make_delegate<Callbacks::CompletedFunction>(completed);
+	}
+
+	Future<void> Add(cppcomponents::use<IEasy> easy, cppcomponents::use<Callbacks::CompletedFunction> func){
+		auto index = Choose(easy);
+		auto multi = multis_[index];
+		auto pcount = &outstanding_[index];
+		use<IMulti> self = QueryInterface<IMulti>();
+
+		auto f = multi.Add(easy, Track(index, easy, func));
+		f.Then([self, pcount, easy](Future<void> f)mutable{
+			if (f.ErrorCode() < 0){
+				--*pcount;
+				ImpEasy::from_ieasy(easy).group_multi_.store(nullptr, std::memory_order_release);
+			}
+		});
+		return f;
+	}
+
+	Future<void> After(std::uint32_t milliseconds){
+		return multis2_[0].After(milliseconds);
+	}
+
+	// Failures come back through the tracked callback, which undoes the count
+	void Start(cppcomponents::use<IEasy> easy, cppcomponents::use<Callbacks::CompletedFunction> func){
+		auto index = Choose(easy);
+		multis2_[index].Start(easy, Track(index, easy, func));
+	}
+
+	Future<void> AddMany(std::vector<use<IEasy>> easies, std::vector<use<Callbacks::CompletedFunction>> funcs){
+		if (easies.size() != funcs.size()){
+			throw error_invalid_arg();
+		}
+		std::vector<std::vector<use<IEasy>>> group_easies(multis_.size());
+		std::vector<std::vector<use<Callbacks::CompletedFunction>>> group_funcs(multis_.size());
+		for (std::size_t i = 0; i < easies.size(); ++i){
+			auto index = Choose(easies[i]);
+			group_funcs[index].push_back(Track(index, easies[i], funcs[i]));
+			group_easies[index].push_back(easies[i]);
+		}
+
+		auto promise = make_promise<void>();
+		auto remaining = std::make_shared<std::atomic<std::size_t>>(0);
+		for (auto& g : group_easies){
+			if (!g.empty()){
+				++*remaining;
+			}
+		}
+		if (*remaining == 0){
+			promise.Set();
+		}
+		for (std::size_t index = 0; index < multis_.size(); ++index){
+			if (group_easies[index].empty()){
+				continue;
+			}
+			// One hop per loop thread, failures are reported through the callbacks
+			multis2_[index].AddMany(group_easies[index], group_funcs[index]).Then([promise, remaining](Future<void>)mutable{
+				if (--*remaining == 0){
+					promise.Set();
+				}
+			});
+		}
+		return promise.QueryInterface<IFuture<void>>();
+	}
+
+	// The multi easy was handed to, -1 if it is not in one of ours
+	int Owner(use<IEasy>& easy){
+		auto owner = ImpEasy::from_ieasy(easy).group_multi_.load(std::memory_order_acquire);
+		for (std::size_t i = 0; i < multis_.size(); ++i){
+			if (multis_[i].get_portable_base() == owner){
+				return static_cast<int>(i);
+			}
+		}
+		return -1;
+	}
+
+	static Future<void> Failed(error_code ec){
+		auto promise = make_promise<void>();
+		promise.SetError(ec);
+		return promise.QueryInterface<IFuture<void>>();
+	}
+
+	Future<void> Remove(cppcomponents::use<IEasy> easy){
+		auto index = Owner(easy);
+		if (index < 0){
+			return Failed(error_invalid_arg::ec);
+		}
+		return multis_[index].Remove(easy);
+	}
+
+	void* GetNative(){
+		return nullptr;
+	}
+
+	// Each multi is on its own thread, so a share of connections is refused
+	// unless there is only one
+	void SetShare(cppcomponents::use<IShare> share){
+		if (share && multis2_.size() > 1 && ImpShare::from_ishare(share).SharesConnections()){
+			throw error_invalid_arg();
+		}
+		for (auto& m : multis2_){
+			m.SetShare(share);
+		}
+	}
+
+	// Sets the option on each multi, so connection limits are per loop thread
+	Future<void> SetInt32Option(std::int32_t option, std::int32_t parameter){
+		auto promise = make_promise<void>();
+		auto remaining = std::make_shared<std::atomic<std::size_t>>(multis_.size());
+		auto error = std::make_shared<std::atomic<error_code>>(0);
+		for (auto& m : multis2_){
+			m.SetInt32Option(option, parameter).Then([promise, remaining, error](Future<void> f)mutable{
+				if (f.ErrorCode() < 0){
+					error_code expected = 0;
+					error->compare_exchange_strong(expected, f.ErrorCode());
+				}
+				if (--*remaining == 0){
+					if (*error < 0){
+						promise.SetError(*error);
+					}
+					else{
+						promise.Set();
+					}
+				}
+			});
+		}
+		return promise.QueryInterface<IFuture<void>>();
+	}
+
+	Future<void> Pause(cppcomponents::use<IEasy> easy, std::int32_t bitmask){
+		auto index = Owner(easy);
+		if (index < 0){
+			return Failed(error_invalid_arg::ec);
+		}
+		return multis2_[index].Pause(easy, bitmask);
+	}
+
+	// Over once no multi of ours has the handle, so there is nothing to do
+	Future<void> PauseTransfer(cppcomponents::use<IEasy> easy, std::uint64_t transfer, std::int32_t bitmask){
+		auto index = Owner(easy);
+		if (index < 0){
+			auto promise = make_promise<void>();
+			promise.Set();
+			return promise.QueryInterface<IFuture<void>>();
+		}
+		return multis2_[index].PauseTransfer(easy, transfer, bitmask);
+	}
+
+	std::uint32_t Size(){
+		return static_cast<std::uint32_t>(multis_.size());
+	}
+
+	cppcomponents::use<IMulti> GetMulti(std::uint32_t index){
+		if (index >= multis_.size()){
+			throw error_invalid_arg();
+		}
+		return multis_[index];
+	}
+
+	std::int32_t Outstanding(std::uint32_t index){
+		if (index >= multis_.size()){
+			throw error_invalid_arg();
+		}
+		return outstanding_[index].load();
+	}
+};
+
+CPPCOMPONENTS_REGISTER(ImpMultiGroup)
+
 struct curl_freer{
 	void* p_;
 	curl_freer(void* p) :p_(p){}
@@ -820,6 +2539,25 @@ struct curl_freer{
 	}
 };
 
+#ifdef _WIN32
+// A replacement operator new only covers its own module on Windows, so the
+// benchmark's misses what the dll allocates unless the dll counts it
+namespace{
+	std::atomic<std::uint64_t> dll_allocations;
+}
+
+void* operator new(std::size_t n){
+	dll_allocations.fetch_add(1, std::memory_order_relaxed);
+	if (auto p = std::malloc(n ? n : 1)){
+		return p;
+	}
+	throw std::bad_alloc();
+}
+void operator delete(void* p) throw(){
+	std::free(p);
+}
+#endif
+
 struct ImpCurlStatics : implement_runtime_class<ImpCurlStatics, Curl_t>
 {
 	ImpCurlStatics(){}
@@ -845,7 +2583,9 @@ struct ImpCurlStatics : implement_runtime_class<ImpCurlStatics, Curl_t>
 		return cr_string{ curl_version() };
 	}
 	static std::chrono::system_clock::time_point GetDate(cppcomponents::cr_string date){
-		auto t = curl_getdate(date.data(),nullptr);
+		// curl_getdate needs a null terminated string, and header values are not
+		auto str = date.to_string();
+		auto t = curl_getdate(str.c_str(), nullptr);
 		return std::chrono::system_clock::from_time_t(t);
 	}
 	static cppcomponents::use<IMulti> DefaultMulti(){
@@ -853,12 +2593,1212 @@ struct ImpCurlStatics : implement_runtime_class<ImpCurlStatics, Curl_t>
 		return cross_compiler_interface::detail::safe_static_init<Multi, uniq>::get();
 
 	}
+	static std::uint64_t Allocations(){
+#ifdef _WIN32
+		return dll_allocations.load(std::memory_order_relaxed);
+#else
+		return 0;
+#endif
+	}
 
 
 };
 
 CPPCOMPONENTS_REGISTER(ImpCurlStatics)
 
+struct ImpResponseCache :implement_runtime_class<ImpResponseCache, ResponseCache_t>
+{
+	typedef std::vector<std::pair<std::string, std::string>> header_list;
+
+	// Immutable once built, so lookups copy the pointer and build the response
+	// outside the shard lock
+	struct entry{
+		std::int32_t response_code;
+		header_list headers;
+		std::vector<use<IBuffer>> body;
+		std::chrono::steady_clock::time_point expires;
+		std::uint64_t bytes;
+	};
+	typedef std::shared_ptr<const entry> entry_ptr;
+	typedef std::list<std::pair<std::string, entry_ptr>> lru_list;
+
+	struct shard{
+		std::mutex mut;
+		// Most recently used first
+		lru_list lru;
+		std::unordered_map<std::string, lru_list::iterator> index;
+		std::uint64_t bytes;
+
+		shard() :bytes{ 0 }{}
+	};
+
+	std::unique_ptr<shard[]> shards_;
+	std::uint32_t shard_count_;
+	std::uint64_t shard_budget_;
+	std::array<std::atomic<std::uint64_t>, CacheCounter::Count> counters_;
+
+	ImpResponseCache(std::uint64_t max_bytes, std::uint32_t shards)
+		:shard_count_{ shards ? shards : 16 }
+	{
+		if (max_bytes == 0){
+			throw error_invalid_arg();
+		}
+		shards_.reset(new shard[shard_count_]);
+		shard_budget_ = max_bytes / shard_count_;
+		for (auto& c : counters_){
+			c.store(0);
+		}
+	}
+
+	void add(std::int32_t counter){
+		counters_[counter].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	shard& shard_for(const std::string& key){
+		return shards_[std::hash<std::string>()(key) % shard_count_];
+	}
+
+	static bool iequals(const std::string& a, const char* b){
+		auto n = std::strlen(b);
+		if (a.size() != n){
+			return false;
+		}
+		for (std::size_t i = 0; i < n; ++i){
+			if (std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i]))){
+				return false;
+			}
+		}
+		return true;
+	}
+
+	static std::string trim(const std::string& s){
+		auto first = s.find_first_not_of(" \t");
+		if (first == std::string::npos){
+			return std::string{};
+		}
+		return s.substr(first, s.find_last_not_of(" \t") - first + 1);
+	}
+
+	// Last header with this name, like IResponse2::Header
+	static const std::string* find_header(const header_list& headers, const char* name){
+		const std::string* value = nullptr;
+		for (auto& h : headers){
+			if (iequals(h.first, name)){
+				value = &h.second;
+			}
+		}
+		return value;
+	}
+
+	static bool parse_date(const std::string* value, std::chrono::system_clock::time_point& t){
+		if (!value){
+			return false;
+		}
+		t = ImpCurlStatics::GetDate(cr_string{ *value });
+		return t != std::chrono::system_clock::from_time_t(-1);
+	}
+
+	// Status codes cacheable by default, RFC 7231 section 6.1
+	static bool cacheable_status(std::int32_t code){
+		switch (code){
+		case 200: case 203: case 204: case 300: case 301: case 404: case 405: case 410: case 414: case 501:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	// Seconds the response stays fresh, -1 if it must not be stored
+	static std::int64_t freshness(std::int32_t code, const header_list& headers){
+		if (!cacheable_status(code) || find_header(headers, "Vary")){
+			return -1;
+		}
+		std::int64_t lifetime = -1;
+		if (auto cc = find_header(headers, "Cache-Control")){
+			std::string directives = *cc;
+			std::transform(directives.begin(), directives.end(), directives.begin(), [](char c){
+				return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+			});
+			std::size_t pos = 0;
+			while (pos <= directives.size()){
+				auto comma = directives.find(',', pos);
+				if (comma == std::string::npos){
+					comma = directives.size();
+				}
+				auto d = trim(directives.substr(pos, comma - pos));
+				pos = comma + 1;
+				if (d == "no-store"){
+					return -1;
+				}
+				if (d == "no-cache"){
+					lifetime = 0;
+				}
+				else if (d.compare(0, 8, "max-age=") == 0 && lifetime != 0){
+					lifetime = std::max<std::int64_t>(0, std::strtoll(d.c_str() + 8, nullptr, 10));
+				}
+			}
+		}
+		if (lifetime < 0){
+			if (auto expires = find_header(headers, "Expires")){
+				std::chrono::system_clock::time_point e, date;
+				lifetime = 0;
+				if (parse_date(expires, e)){
+					if (!parse_date(find_header(headers, "Date"), date)){
+						date = std::chrono::system_clock::now();
+					}
+					lifetime = std::max<std::int64_t>(0, std::chrono::duration_cast<std::chrono::seconds>(e - date).count());
+				}
+			}
+		}
+		bool validator = find_header(headers, "ETag") || find_header(headers, "Last-Modified");
+		if (lifetime <= 0){
+			// Without a validator every use would refetch the whole response anyway
+			return validator ? 0 : -1;
+		}
+		if (auto age = find_header(headers, "Age")){
+			lifetime = std::max<std::int64_t>(0, lifetime - std::strtoll(age->c_str(), nullptr, 10));
+		}
+		return lifetime;
+	}
+
+	// The headers of the last response, from its status line on. Headers() has
+	// those of every response in a redirect chain, and of a 100 Continue
+	static header_list final_headers(header_list headers){
+		std::size_t last = 0;
+		for (std::size_t i = 0; i < headers.size(); ++i){
+			if (headers[i].first.compare(0, 5, "HTTP/") == 0){
+				last = i;
+			}
+		}
+		headers.erase(headers.begin(), headers.begin() + last);
+		return headers;
+	}
+
+	static use<IResponse> make_response(std::int32_t code, const header_list& headers, const std::vector<use<IBuffer>>& body){
+		Response r{ use<IEasy>{} };
+		r.QueryInterface<IResponseWriter2>().CompleteFrom(code, headers, body);
+		return r.QueryInterface<IResponse>();
+	}
+
+	// The headers of stale, updated with the ones sent with a 304
+	static header_list not_modified_headers(use<IResponse> stale, use<IResponse> response){
+		auto headers = stale.Headers();
+		for (auto& h : final_headers(response.Headers())){
+			if (h.second.empty() || iequals(h.first, "Content-Length") || iequals(h.first, "Transfer-Encoding")){
+				continue;
+			}
+			auto iter = std::find_if(headers.begin(), headers.end(), [&h](const std::pair<std::string, std::string>& s){
+				return iequals(s.first, h.first.c_str());
+			});
+			if (iter != headers.end()){
+				iter->second = h.second;
+			}
+			else{
+				headers.push_back(h);
+			}
+		}
+		return headers;
+	}
+
+	entry_ptr find(const std::string& key, bool fresh_only){
+		auto& s = shard_for(key);
+		std::unique_lock<std::mutex> lock{ s.mut };
+		auto iter = s.index.find(key);
+		if (iter == s.index.end()){
+			return nullptr;
+		}
+		auto e = iter->second->second;
+		if (fresh_only && std::chrono::steady_clock::now() >= e->expires){
+			return nullptr;
+		}
+		s.lru.splice(s.lru.begin(), s.lru, iter->second);
+		return e;
+	}
+
+	void erase(shard& s, std::unordered_map<std::string, lru_list::iterator>::iterator iter){
+		s.bytes -= iter->second->second->bytes;
+		s.lru.erase(iter->second);
+		s.index.erase(iter);
+	}
+
+	// Stores the response, or drops what was stored for key if it cannot be cached
+	void store(const std::string& key, std::int32_t code, header_list headers, std::vector<use<IBuffer>> body){
+		auto lifetime = freshness(code, headers);
+		auto& s = shard_for(key);
+		if (lifetime < 0){
+			std::unique_lock<std::mutex> lock{ s.mut };
+			auto iter = s.index.find(key);
+			if (iter != s.index.end()){
+				erase(s, iter);
+			}
+			return;
+		}
+		auto e = std::make_shared<entry>();
+		e->response_code = code;
+		e->bytes = key.size() + sizeof(entry);
+		for (auto& h : headers){
+			e->bytes += h.first.size() + h.second.size();
+		}
+		for (auto& b : body){
+			e->bytes += b.Size();
+		}
+		e->headers = std::move(headers);
+		e->body = std::move(body);
+		e->expires = std::chrono::steady_clock::now() + std::chrono::seconds(lifetime);
+
+		std::unique_lock<std::mutex> lock{ s.mut };
+		auto iter = s.index.find(key);
+		if (iter != s.index.end()){
+			erase(s, iter);
+		}
+		if (e->bytes > shard_budget_){
+			return;
+		}
+		s.lru.push_front(std::make_pair(key, entry_ptr{ e }));
+		s.index[key] = s.lru.begin();
+		s.bytes += e->bytes;
+		add(CacheCounter::Stores);
+		while (s.bytes > shard_budget_){
+			erase(s, s.index.find(s.lru.back().first));
+			add(CacheCounter::Evictions);
+		}
+	}
+
+	use<IResponse> GetFresh(cppcomponents::cr_string key){
+		auto e = find(key.to_string(), true);
+		if (!e){
+			return nullptr;
+		}
+		add(CacheCounter::Hits);
+		return make_response(e->response_code, e->headers, e->body);
+	}
+
+	use<IResponse> GetStale(cppcomponents::cr_string key){
+		auto e = find(key.to_string(), false);
+		if (!e){
+			add(CacheCounter::Misses);
+			return nullptr;
+		}
+		return make_response(e->response_code, e->headers, e->body);
+	}
+
+	use<IResponse> Update(cppcomponents::cr_string key, use<IResponse> response, use<IResponse> stale){
+		if (!response){
+			throw error_invalid_arg();
+		}
+		if (response.ErrorCode() < 0){
+			return response;
+		}
+		auto k = key.to_string();
+		auto code = response.ResponseCode();
+		if (code == 304 && stale){
+			add(CacheCounter::Revalidated);
+			auto headers = not_modified_headers(stale, response);
+			auto body = stale.QueryInterface<IResponse2>().BodyBuffers();
+			store(k, stale.ResponseCode(), headers, body);
+			return make_response(stale.ResponseCode(), headers, body);
+		}
+		if (stale){
+			add(CacheCounter::RevalidationChanged);
+		}
+		// BodyBuffers stops the response handing its segments back to the pool,
+		// so the entry can share them
+		store(k, code, final_headers(response.Headers()), response.QueryInterface<IResponse2>().BodyBuffers());
+		return response;
+	}
+
+	void Remove(cppcomponents::cr_string key){
+		auto k = key.to_string();
+		auto& s = shard_for(k);
+		std::unique_lock<std::mutex> lock{ s.mut };
+		auto iter = s.index.find(k);
+		if (iter != s.index.end()){
+			erase(s, iter);
+		}
+	}
+
+	void Clear(){
+		for (std::uint32_t i = 0; i < shard_count_; ++i){
+			auto& s = shards_[i];
+			std::unique_lock<std::mutex> lock{ s.mut };
+			s.index.clear();
+			s.lru.clear();
+			s.bytes = 0;
+		}
+	}
+
+	std::vector<std::uint64_t> Counters(){
+		std::vector<std::uint64_t> ret(CacheCounter::Count);
+		for (std::size_t i = 0; i < ret.size(); ++i){
+			ret[i] = counters_[i].load(std::memory_order_relaxed);
+		}
+		ret[CacheCounter::Entries] = 0;
+		ret[CacheCounter::Bytes] = 0;
+		for (std::uint32_t i = 0; i < shard_count_; ++i){
+			auto& s = shards_[i];
+			std::unique_lock<std::mutex> lock{ s.mut };
+			ret[CacheCounter::Entries] += s.index.size();
+			ret[CacheCounter::Bytes] += s.bytes;
+		}
+		return ret;
+	}
+};
+
+CPPCOMPONENTS_REGISTER(ImpResponseCache)
+
+// Read only mapping of a whole file, as large as the file was when mapped
+struct mapped_file{
+	const char* data_;
+	std::uint64_t size_;
+#ifdef _WIN32
+	HANDLE mapping_;
+#endif
+
+	mapped_file() :data_{ nullptr }, size_{ 0 }
+#ifdef _WIN32
+		, mapping_{ nullptr }
+#endif
+	{}
+
+	~mapped_file(){
+		unmap();
+	}
+
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+
+	// False if the file is missing, empty or cannot be mapped
+	bool map(const std::string& path){
+		unmap();
+#ifdef _WIN32
+		auto file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE){
+			return false;
+		}
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size) || size.QuadPart == 0){
+			CloseHandle(file);
+			return false;
+		}
+		mapping_ = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		CloseHandle(file);
+		if (!mapping_){
+			return false;
+		}
+		data_ = static_cast<const char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+		if (!data_){
+			CloseHandle(mapping_);
+			mapping_ = nullptr;
+			return false;
+		}
+		size_ = static_cast<std::uint64_t>(size.QuadPart);
+#else
+		auto fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0){
+			return false;
+		}
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0){
+			::close(fd);
+			return false;
+		}
+		auto p = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (p == MAP_FAILED){
+			return false;
+		}
+		data_ = static_cast<const char*>(p);
+		size_ = static_cast<std::uint64_t>(st.st_size);
+#endif
+		return true;
+	}
+
+	void unmap(){
+		if (!data_){
+			return;
+		}
+#ifdef _WIN32
+		UnmapViewOfFile(data_);
+		CloseHandle(mapping_);
+		mapping_ = nullptr;
+#else
+		munmap(const_cast<char*>(data_), static_cast<std::size_t>(size_));
+#endif
+		data_ = nullptr;
+		size_ = 0;
+	}
+};
+
+inline std::string mapped_buffer_id(){ return "cppcomponents_libcurl_libuv_dll!MappedBuffer"; }
+typedef cppcomponents::runtime_class<mapped_buffer_id, cppcomponents::object_interfaces<IBuffer>,
+	cppcomponents::factory_interface<cppcomponents::NoConstructorFactoryInterface>> MappedBuffer_t;
+
+// A body in a disk cache segment, read in place. It keeps the mapping alive,
+// which is read only, so it must not be written through Begin
+struct ImpMappedBuffer :implement_runtime_class<ImpMappedBuffer, MappedBuffer_t>
+{
+	std::shared_ptr<mapped_file> file_;
+	char* begin_;
+	std::size_t size_;
+
+	ImpMappedBuffer(std::shared_ptr<mapped_file> file, const char* begin, std::size_t size)
+		:file_{ std::move(file) }, begin_{ const_cast<char*>(begin) }, size_{ size }
+	{}
+
+	char* Begin(){
+		return begin_;
+	}
+	char* End(){
+		return begin_ + size_;
+	}
+	std::size_t Size(){
+		return size_;
+	}
+	std::size_t Capacity(){
+		return size_;
+	}
+	void SetSize(std::size_t size){
+		if (size > size_){
+			throw error_invalid_arg();
+		}
+		size_ = size;
+	}
+};
+
+struct ImpDiskResponseCache :implement_runtime_class<ImpDiskResponseCache, DiskResponseCache_t>
+{
+	typedef ImpResponseCache::header_list header_list;
+
+	enum : std::uint32_t{ record_magic = 0x31524344, index_magic = 0x31494344 };
+
+	// Followed by the key, the headers as name\0value\0 pairs and the body
+	struct record_header{
+		std::uint32_t magic;
+		// 0 marks a removed key
+		std::int32_t response_code;
+		// Seconds since the epoch
+		std::int64_t expires;
+		std::uint64_t body_size;
+		std::uint32_t key_size;
+		std::uint32_t headers_size;
+	};
+
+	// Where the newest record of a key is. The index is keyed by a hash of the
+	// key, the key in the record is compared on lookup
+	struct location{
+		std::uint32_t segment;
+		std::uint32_t reserved;
+		std::uint64_t offset;
+		std::int64_t expires;
+	};
+
+	struct segment{
+		std::uint64_t size;
+		// Replaced when a record is past its end, a reader keeps the one it copies from
+		std::shared_ptr<mapped_file> map;
+
+		segment() :size{ 0 }{}
+	};
+
+	// A record to append, or the files to delete, in the order of the calls
+	struct pending_write{
+		enum { append, clear } kind;
+		std::string key;
+		std::int32_t code;
+		std::int64_t expires;
+		header_list headers;
+		std::vector<use<IBuffer>> body;
+		std::uint64_t seq;
+		std::uint64_t bytes;
+
+		pending_write() :kind{ append }, code{ 0 }, expires{ 0 }, seq{ 0 }, bytes{ 0 }{}
+	};
+
+	// Guards the index and the segment table. Only the writer thread changes the
+	// files and the segment table, and it does not hold the lock while it writes
+	std::mutex mut_;
+	std::string directory_;
+	std::uint64_t max_bytes_;
+	std::uint64_t segment_bytes_;
+	// Oldest first, the last one is appended to
+	std::map<std::uint32_t, std::unique_ptr<segment>> segments_;
+	std::unordered_map<std::uint64_t, location> index_;
+	// The last write queued for a key hash. A record is only indexed if no later
+	// write for its key was queued, and skipped if one was
+	std::unordered_map<std::uint64_t, std::uint64_t> latest_;
+	std::uint64_t seq_;
+	std::uint64_t bytes_;
+	// Only used on the writer thread, and before it starts and after it stops
+	std::uint32_t next_id_;
+	FILE* active_;
+	// The last segment ends in a partly written record, so appends go to a new one
+	bool torn_;
+
+	// Writes run on a thread of their own so Update, usually called on the loop
+	// thread, does not wait for the disk
+	std::mutex writes_mut_;
+	std::condition_variable writes_cond_;
+	std::deque<pending_write> writes_;
+	// Bytes of the records queued, past a segment's worth new stores are dropped
+	std::uint64_t pending_bytes_;
+	bool stopping_;
+	std::thread writer_;
+
+	std::array<std::atomic<std::uint64_t>, CacheCounter::Count> counters_;
+
+	ImpDiskResponseCache(cppcomponents::cr_string directory, std::uint64_t max_bytes)
+		:directory_{ directory.to_string() }, max_bytes_{ max_bytes }, seq_{ 0 }, bytes_{ 0 }, next_id_{ 0 },
+		active_{ nullptr }, torn_{ false }, pending_bytes_{ 0 }, stopping_{ false }
+	{
+		if (directory_.empty() || max_bytes == 0){
+			throw error_invalid_arg();
+		}
+		while (directory_.size() > 1 && (directory_.back() == '/' || directory_.back() == '\\')){
+			directory_.pop_back();
+		}
+		// Small enough that evicting the oldest segment does not empty the cache
+		segment_bytes_ = max_bytes_ / 8;
+		if (segment_bytes_ < 1024 * 1024){
+			segment_bytes_ = 1024 * 1024;
+		}
+		if (segment_bytes_ > 256 * 1024 * 1024){
+			segment_bytes_ = 256 * 1024 * 1024;
+		}
+		for (auto& c : counters_){
+			c.store(0);
+		}
+		Open();
+		writer_ = std::thread{ [this](){ WriterLoop(); } };
+	}
+
+	~ImpDiskResponseCache(){
+		{
+			std::unique_lock<std::mutex> lock{ writes_mut_ };
+			stopping_ = true;
+		}
+		writes_cond_.notify_one();
+		// Finishes the queued writes first
+		writer_.join();
+		if (active_){
+			std::fclose(active_);
+		}
+		WriteIndex();
+	}
+
+	void add(std::int32_t counter){
+		counters_[counter].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// FNV-1a, stable across processes unlike std::hash
+	static std::uint64_t hash_key(const std::string& key){
+		std::uint64_t h = 14695981039346656037ull;
+		for (auto c : key){
+			h ^= static_cast<unsigned char>(c);
+			h *= 1099511628211ull;
+		}
+		return h;
+	}
+
+	static std::int64_t now_seconds(){
+		return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	// Null if the file is missing, empty or cannot be mapped
+	static std::shared_ptr<mapped_file> map_file(const std::string& path){
+		auto m = std::make_shared<mapped_file>();
+		if (!m->map(path)){
+			return nullptr;
+		}
+		return m;
+	}
+
+	std::string segment_path(std::uint32_t id){
+		char name[32];
+		std::sprintf(name, "/segment-%08x.dat", id);
+		return directory_ + name;
+	}
+	std::string index_path(){
+		return directory_ + "/index.dat";
+	}
+
+	template<class T>
+	static void put(std::string& out, const T& v){
+		out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+	}
+	template<class T>
+	static bool get(const std::vector<char>& in, std::size_t& pos, T& v){
+		if (in.size() - pos < sizeof(v)){
+			return false;
+		}
+		std::memcpy(&v, in.data() + pos, sizeof(v));
+		pos += sizeof(v);
+		return true;
+	}
+
+	// Segment table with the size of each segment, then the index. Runs on the
+	// writer thread, or when it is not running
+	void WriteIndex(){
+		std::string out;
+		{
+			std::unique_lock<std::mutex> lock{ mut_ };
+			put(out, static_cast<std::uint32_t>(index_magic));
+			put(out, next_id_);
+			put(out, static_cast<std::uint32_t>(segments_.size()));
+			for (auto& s : segments_){
+				put(out, s.first);
+				put(out, s.second->size);
+			}
+			put(out, static_cast<std::uint64_t>(index_.size()));
+			for (auto& e : index_){
+				put(out, e.first);
+				put(out, e.second);
+			}
+		}
+		auto tmp = index_path() + ".tmp";
+		auto f = std::fopen(tmp.c_str(), "wb");
+		if (!f){
+			return;
+		}
+		auto ok = std::fwrite(out.data(), 1, out.size(), f) == out.size();
+		ok = std::fclose(f) == 0 && ok;
+		if (!ok){
+			std::remove(tmp.c_str());
+			return;
+		}
+		std::remove(index_path().c_str());
+		std::rename(tmp.c_str(), index_path().c_str());
+	}
+
+	// Sizes of the segments when the index was written, empty if there is no usable index
+	std::map<std::uint32_t, std::uint64_t> ReadIndex(){
+		std::map<std::uint32_t, std::uint64_t> sizes;
+		auto f = std::fopen(index_path().c_str(), "rb");
+		if (!f){
+			return sizes;
+		}
+		std::vector<char> in;
+		char buf[64 * 1024];
+		for (;;){
+			auto n = std::fread(buf, 1, sizeof(buf), f);
+			in.insert(in.end(), buf, buf + n);
+			if (n < sizeof(buf)){
+				break;
+			}
+		}
+		std::fclose(f);
+
+		std::size_t pos = 0;
+		std::uint32_t magic = 0, next_id = 0, count = 0;
+		if (!get(in, pos, magic) || magic != index_magic || !get(in, pos, next_id) || !get(in, pos, count)){
+			return sizes;
+		}
+		for (std::uint32_t i = 0; i < count; ++i){
+			std::uint32_t id;
+			std::uint64_t size;
+			if (!get(in, pos, id) || !get(in, pos, size)){
+				sizes.clear();
+				return sizes;
+			}
+			sizes[id] = size;
+		}
+		std::uint64_t entries = 0;
+		if (!get(in, pos, entries)){
+			sizes.clear();
+			return sizes;
+		}
+		for (std::uint64_t i = 0; i < entries; ++i){
+			std::uint64_t hash;
+			location loc;
+			if (!get(in, pos, hash) || !get(in, pos, loc)){
+				index_.clear();
+				sizes.clear();
+				return sizes;
+			}
+			if (sizes.count(loc.segment)){
+				index_[hash] = loc;
+			}
+		}
+		next_id_ = next_id;
+		return sizes;
+	}
+
+	// Indexes the records of a segment from offset on, returns where the last
+	// whole record ends
+	std::uint64_t Scan(std::uint32_t id, segment& seg, std::uint64_t offset){
+		auto& m = *seg.map;
+		while (m.size_ - offset >= sizeof(record_header)){
+			record_header h;
+			std::memcpy(&h, m.data_ + offset, sizeof(h));
+			auto total = sizeof(h) + static_cast<std::uint64_t>(h.key_size) + h.headers_size + h.body_size;
+			if (h.magic != record_magic || m.size_ - offset < total){
+				break;
+			}
+			auto hash = hash_key(std::string(m.data_ + offset + sizeof(h), h.key_size));
+			if (h.response_code == 0){
+				index_.erase(hash);
+			}
+			else{
+				location loc = { id, 0, offset, h.expires };
+				index_[hash] = loc;
+			}
+			offset += total;
+		}
+		return offset;
+	}
+
+	// Drops the segment and what it held from the tables, the caller deletes the
+	// file. Runs with mut_ held, or before the writer thread starts
+	void Forget(std::uint32_t id){
+		for (auto iter = index_.begin(); iter != index_.end();){
+			if (iter->second.segment == id){
+				iter = index_.erase(iter);
+				add(CacheCounter::Evictions);
+			}
+			else{
+				++iter;
+			}
+		}
+		auto iter = segments_.find(id);
+		if (iter != segments_.end()){
+			bytes_ -= iter->second->size;
+			segments_.erase(iter);
+		}
+	}
+
+	// Loads the index written by the last process, then only reads the records
+	// appended after it was written
+	void Open(){
+		auto sizes = ReadIndex();
+		for (auto& s : sizes){
+			std::unique_ptr<segment> seg{ new segment };
+			seg->map = map_file(segment_path(s.first));
+			if (!seg->map || seg->map->size_ < s.second){
+				// Gone or cut short, drop whatever it held
+				segments_[s.first] = std::move(seg);
+				Forget(s.first);
+				std::remove(segment_path(s.first).c_str());
+				continue;
+			}
+			auto end = s.second;
+			if (seg->map->size_ > s.second){
+				end = Scan(s.first, *seg, s.second);
+			}
+			seg->size = seg->map->size_;
+			torn_ = end != seg->size;
+			bytes_ += seg->size;
+			segments_[s.first] = std::move(seg);
+		}
+		// Segments started after the index was written
+		for (;; ++next_id_){
+			std::unique_ptr<segment> seg{ new segment };
+			seg->map = map_file(segment_path(next_id_));
+			if (!seg->map){
+				break;
+			}
+			auto end = Scan(next_id_, *seg, 0);
+			seg->size = seg->map->size_;
+			torn_ = end != seg->size;
+			bytes_ += seg->size;
+			segments_[next_id_] = std::move(seg);
+		}
+		if (!segments_.empty() && segments_.rbegin()->first >= next_id_){
+			next_id_ = segments_.rbegin()->first + 1;
+		}
+		// Covers the segments scanned above
+		if (!Evict()){
+			WriteIndex();
+		}
+	}
+
+	void WriterLoop(){
+		for (;;){
+			pending_write w;
+			{
+				std::unique_lock<std::mutex> lock{ writes_mut_ };
+				while (writes_.empty() && !stopping_){
+					writes_cond_.wait(lock);
+				}
+				if (writes_.empty()){
+					return;
+				}
+				w = std::move(writes_.front());
+				writes_.pop_front();
+			}
+			try{
+				if (w.kind == pending_write::append){
+					Append(w.key, w.code, w.expires, w.headers, w.body, w.seq);
+				}
+				else{
+					DeleteAll();
+				}
+			}
+			catch (...){
+				// swallow exceptions
+			}
+			if (w.bytes){
+				std::unique_lock<std::mutex> lock{ writes_mut_ };
+				pending_bytes_ -= w.bytes;
+			}
+		}
+	}
+
+	void Post(pending_write w){
+		{
+			std::unique_lock<std::mutex> lock{ writes_mut_ };
+			writes_.push_back(std::move(w));
+		}
+		writes_cond_.notify_one();
+	}
+
+	// Runs on the writer thread
+	void Rotate(){
+		if (active_){
+			std::fclose(active_);
+			active_ = nullptr;
+		}
+		auto id = next_id_++;
+		active_ = std::fopen(segment_path(id).c_str(), "wb");
+		if (!active_){
+			throw error_fail();
+		}
+		{
+			std::unique_lock<std::mutex> lock{ mut_ };
+			segments_[id] = std::unique_ptr<segment>{ new segment };
+		}
+		torn_ = false;
+		WriteIndex();
+	}
+
+	// Runs on the writer thread, or before it starts. The index is only written
+	// again if a segment was dropped, false if none was
+	bool Evict(){
+		std::vector<std::uint32_t> dropped;
+		{
+			std::unique_lock<std::mutex> lock{ mut_ };
+			while (bytes_ > max_bytes_ && segments_.size() > 1){
+				dropped.push_back(segments_.begin()->first);
+				Forget(segments_.begin()->first);
+			}
+		}
+		if (dropped.empty()){
+			return false;
+		}
+		for (auto id : dropped){
+			std::remove(segment_path(id).c_str());
+		}
+		WriteIndex();
+		return true;
+	}
+
+	// Runs on the writer thread
+	void DeleteAll(){
+		if (active_){
+			std::fclose(active_);
+			active_ = nullptr;
+		}
+		std::vector<std::uint32_t> dropped;
+		{
+			std::unique_lock<std::mutex> lock{ mut_ };
+			while (!segments_.empty()){
+				dropped.push_back(segments_.begin()->first);
+				Forget(segments_.begin()->first);
+			}
+		}
+		for (auto id : dropped){
+			std::remove(segment_path(id).c_str());
+		}
+		WriteIndex();
+	}
+
+	// Runs on the writer thread. Appends a record unless a later write for the
+	// key was queued since, returns false if it could not be written
+	bool Append(const std::string& key, std::int32_t code, std::int64_t expires, const header_list& headers,
+		const std::vector<use<IBuffer>>& body, std::uint64_t seq){
+		auto hash = hash_key(key);
+		{
+			std::unique_lock<std::mutex> lock{ mut_ };
+			auto latest = latest_.find(hash);
+			if (latest == latest_.end() || latest->second != seq){
+				return false;
+			}
+		}
+		std::string head;
+		record_header h = {};
+		h.magic = record_magic;
+		h.response_code = code;
+		h.expires = expires;
+		for (auto& b : body){
+			h.body_size += b.Size();
+		}
+		h.key_size = static_cast<std::uint32_t>(key.size());
+		put(head, h);
+		head.append(key);
+		for (auto& p : headers){
+			head.append(p.first);
+			head.push_back('\0');
+			head.append(p.second);
+			head.push_back('\0');
+		}
+		h.headers_size = static_cast<std::uint32_t>(head.size() - sizeof(h) - key.size());
+		std::memcpy(&head[0], &h, sizeof(h));
+
+		bool ok = true;
+		try{
+			if (segments_.empty() || torn_ || segments_.rbegin()->second->size >= segment_bytes_){
+				Rotate();
+			}
+			else if (!active_){
+				active_ = std::fopen(segment_path(segments_.rbegin()->first).c_str(), "ab");
+				ok = active_ != nullptr;
+			}
+		}
+		catch (std::exception&){
+			ok = false;
+		}
+		if (ok){
+			ok = std::fwrite(head.data(), 1, head.size(), active_) == head.size();
+			for (auto& b : body){
+				ok = ok && std::fwrite(b.Begin(), 1, b.Size(), active_) == b.Size();
+			}
+			ok = std::fflush(active_) == 0 && ok;
+			if (!ok){
+				// Whatever made it to the file is skipped by later scans
+				torn_ = true;
+			}
+		}
+		auto id = segments_.empty() ? 0 : segments_.rbegin()->first;
+		auto total = head.size() + h.body_size;
+		bool over = false;
+		{
+			std::unique_lock<std::mutex> lock{ mut_ };
+			auto latest = latest_.find(hash);
+			bool current = latest != latest_.end() && latest->second == seq;
+			if (current){
+				latest_.erase(latest);
+			}
+			if (!ok){
+				return false;
+			}
+			auto& seg = *segments_.rbegin()->second;
+			if (current && code != 0){
+				location loc = { id, 0, seg.size, expires };
+				index_[hash] = loc;
+			}
+			seg.size += total;
+			bytes_ += total;
+			over = bytes_ > max_bytes_;
+		}
+		if (over){
+			Evict();
+		}
+		return true;
+	}
+
+	// Takes key out of the index now, and queues a record that removes it from
+	// the files if they may have one
+	void Drop(const std::string& key){
+		auto hash = hash_key(key);
+		pending_write w;
+		{
+			std::unique_lock<std::mutex> lock{ mut_ };
+			auto stored = index_.erase(hash) != 0 || latest_.count(hash) != 0;
+			if (!stored){
+				return;
+			}
+			w.seq = ++seq_;
+			latest_[hash] = w.seq;
+		}
+		w.key = key;
+		Post(std::move(w));
+	}
+
+	// The mapping holding the record at loc if it holds key. Runs with mut_ held
+	std::shared_ptr<mapped_file> Map(const location& loc, const std::string& key, record_header& h){
+		auto iter = segments_.find(loc.segment);
+		if (iter == segments_.end()){
+			return nullptr;
+		}
+		auto& seg = *iter->second;
+		// A segment is mapped again once records were appended past its end
+		auto covers = [&](std::uint64_t end) -> bool{
+			if (seg.map && seg.map->size_ >= end){
+				return true;
+			}
+			auto m = map_file(segment_path(loc.segment));
+			if (!m || m->size_ < end){
+				return false;
+			}
+			seg.map = m;
+			return true;
+		};
+		if (!covers(loc.offset + sizeof(h))){
+			return nullptr;
+		}
+		std::memcpy(&h, seg.map->data_ + loc.offset, sizeof(h));
+		auto total = sizeof(h) + static_cast<std::uint64_t>(h.key_size) + h.headers_size + h.body_size;
+		if (!covers(loc.offset + total)){
+			return nullptr;
+		}
+		if (h.magic != record_magic || h.key_size != key.size()
+			|| !std::equal(key.begin(), key.end(), seg.map->data_ + loc.offset + sizeof(h))){
+			return nullptr;
+		}
+		return seg.map;
+	}
+
+	use<IResponse> Read(const std::string& key, bool fresh_only){
+		location loc;
+		record_header h;
+		std::shared_ptr<mapped_file> file;
+		{
+			std::unique_lock<std::mutex> lock{ mut_ };
+			auto iter = index_.find(hash_key(key));
+			if (iter == index_.end()){
+				return nullptr;
+			}
+			loc = iter->second;
+			if (fresh_only && now_seconds() >= loc.expires){
+				return nullptr;
+			}
+			file = Map(loc, key, h);
+			if (!file){
+				return nullptr;
+			}
+		}
+		// Records are never written over, and the mapping lives as long as file,
+		// so the headers are read without holding up other readers or the writer
+		auto p = file->data_ + loc.offset + sizeof(h) + h.key_size;
+		auto headers_end = p + h.headers_size;
+		header_list headers;
+		while (p < headers_end){
+			auto name_end = std::find(p, headers_end, '\0');
+			auto value_end = std::find(name_end + (name_end != headers_end), headers_end, '\0');
+			if (value_end == headers_end){
+				return nullptr;
+			}
+			headers.push_back(std::make_pair(std::string(p, name_end), std::string(name_end + 1, value_end)));
+			p = value_end + 1;
+		}
+		// The body is not copied, the buffer points into the mapping
+		std::vector<use<IBuffer>> body;
+		if (h.body_size){
+			body.push_back(ImpMappedBuffer::create(file, headers_end, static_cast<std::size_t>(h.body_size))
+				.QueryInterface<IBuffer>());
+		}
+		return ImpResponseCache::make_response(h.response_code, headers, body);
+	}
+
+	// Queues the record. While the writer is more than a segment behind the
+	// response is not stored, and what was stored for key is dropped
+	void Store(const std::string& key, std::int32_t code, const header_list& headers,
+		const std::vector<use<IBuffer>>& body){
+		auto lifetime = ImpResponseCache::freshness(code, headers);
+		if (lifetime < 0){
+			Drop(key);
+			return;
+		}
+		pending_write w;
+		w.bytes = sizeof(record_header) + key.size();
+		for (auto& p : headers){
+			w.bytes += p.first.size() + p.second.size() + 2;
+		}
+		for (auto& b : body){
+			w.bytes += b.Size();
+		}
+		{
+			std::unique_lock<std::mutex> lock{ writes_mut_ };
+			if (pending_bytes_ && pending_bytes_ + w.bytes > segment_bytes_){
+				lock.unlock();
+				Drop(key);
+				return;
+			}
+			pending_bytes_ += w.bytes;
+		}
+		{
+			std::unique_lock<std::mutex> lock{ mut_ };
+			w.seq = ++seq_;
+			latest_[hash_key(key)] = w.seq;
+		}
+		w.key = key;
+		w.code = code;
+		w.expires = now_seconds() + lifetime;
+		w.headers = headers;
+		w.body = body;
+		Post(std::move(w));
+		add(CacheCounter::Stores);
+	}
+
+	use<IResponse> GetFresh(cppcomponents::cr_string key){
+		auto r = Read(key.to_string(), true);
+		if (r){
+			add(CacheCounter::Hits);
+		}
+		return r;
+	}
+
+	use<IResponse> GetStale(cppcomponents::cr_string key){
+		auto r = Read(key.to_string(), false);
+		if (!r){
+			add(CacheCounter::Misses);
+		}
+		return r;
+	}
+
+	use<IResponse> Update(cppcomponents::cr_string key, use<IResponse> response, use<IResponse> stale){
+		if (!response){
+			throw error_invalid_arg();
+		}
+		if (response.ErrorCode() < 0){
+			return response;
+		}
+		auto k = key.to_string();
+		auto code = response.ResponseCode();
+		if (code == 304 && stale){
+			add(CacheCounter::Revalidated);
+			auto headers = ImpResponseCache::not_modified_headers(stale, response);
+			auto body = stale.QueryInterface<IResponse2>().BodyBuffers();
+			Store(k, stale.ResponseCode(), headers, body);
+			return ImpResponseCache::make_response(stale.ResponseCode(), headers, body);
+		}
+		if (stale){
+			add(CacheCounter::RevalidationChanged);
+		}
+		Store(k, code, ImpResponseCache::final_headers(response.Headers()), response.QueryInterface<IResponse2>().BodyBuffers());
+		return response;
+	}
+
+	void Remove(cppcomponents::cr_string key){
+		Drop(key.to_string());
+	}
+
+	// Empties the index now, the writer deletes the files once the writes queued
+	// before are done, and skips those
+	void Clear(){
+		{
+			std::unique_lock<std::mutex> lock{ mut_ };
+			index_.clear();
+			latest_.clear();
+		}
+		pending_write w;
+		w.kind = pending_write::clear;
+		Post(std::move(w));
+	}
+
+	std::vector<std::uint64_t> Counters(){
+		std::vector<std::uint64_t> ret(CacheCounter::Count);
+		for (std::size_t i = 0; i < ret.size(); ++i){
+			ret[i] = counters_[i].load(std::memory_order_relaxed);
+		}
+		std::unique_lock<std::mutex> lock{ mut_ };
+		ret[CacheCounter::Entries] = index_.size();
+		ret[CacheCounter::Bytes] = bytes_;
+		return ret;
+	}
+};
+
+CPPCOMPONENTS_REGISTER(ImpDiskResponseCache)
+
 struct CurlInit{
 	CurlInit(){
 		curl_global_init(CURL_GLOBAL_ALL);
@@ -51,6 +51,35 @@ namespace cppcomponents_libcurl_libuv{
 	typedef cppcomponents::runtime_class<form_id, cppcomponents::object_interfaces<IForm>> Form_t;
 	typedef cppcomponents::use_runtime_class<Form_t> Form;
 
+	struct IShare :cppcomponents::define_interface<cppcomponents::uuid<0x2c9d41e7, 0x8f53, 0x4a0b, 0x96d2, 0x71e8b3c05f4d>>
+	{
+		// data is one of Constants::Share::CURL_LOCK_DATA_*
+		// Must be called before the share is attached to a handle
+		// libcurl's connection cache may only be used from one thread, so
+		// CURL_LOCK_DATA_CONNECT fails once more than one multi uses the share
+		void Share(std::int32_t data);
+		void Unshare(std::int32_t data);
+
+		void* GetNative();
+
+		CPPCOMPONENTS_CONSTRUCT(IShare, Share, Unshare, GetNative);
+	};
+
+	inline std::string share_id(){ return "cppcomponents_libcurl_libuv_dll!Share"; }
+	typedef cppcomponents::runtime_class<share_id, cppcomponents::object_interfaces<IShare>> Share_t;
+	typedef cppcomponents::use_runtime_class<Share_t> Share;
+
+	// Scheduling classes for IEasy2::SetPriority. A Multi with waiting transfers
+	// starts the higher classes first
+	namespace TransferPriority{
+		enum{
+			High = 0,
+			Normal = 1,
+			Low = 2,
+			Count = 3
+		};
+	}
+
 	struct IEasy :cppcomponents::define_interface<cppcomponents::uuid<0x6182019d, 0x4991, 0x4690, 0x9ee4, 0xf3066ee30e8e>>{
 		void SetInt32Option(std::int32_t option, std::int32_t parameter);
 		void SetPointerOption(std::int32_t option, void* parameter);
@@ -83,10 +112,142 @@ namespace cppcomponents_libcurl_libuv{
 			}
 		};
 	};
+	// Implemented by Easy, query it from the IEasy
+	struct IEasy2 :cppcomponents::define_interface<cppcomponents::uuid<0x9a4e1c37, 0x52d8, 0x4f6b, 0xb0a9, 0x3c7e15d2f864>>{
+		// New handle with the same options, made with curl_easy_duphandle
+		// Private data stored with StorePrivate is not copied
+		cppcomponents::use<IEasy> Duplicate();
+
+		// One of TransferPriority, Reset goes back to Normal
+		void SetPriority(std::int32_t priority);
+		std::int32_t GetPriority();
+
+		// Seconds from IMulti::Add until the multi handed the last transfer to libcurl
+		double GetQueueTime();
+
+		// Counts the transfers the handle was handed to libcurl for. Read it while
+		// the transfer runs to pass to IMulti2::PauseTransfer
+		std::uint64_t GetTransfer();
+
+		CPPCOMPONENTS_CONSTRUCT(IEasy2, Duplicate, SetPriority, GetPriority, GetQueueTime, GetTransfer);
+	};
+
 	inline std::string easy_id(){ return "cppcomponents_libcurl_libuv_dll!Easy"; }
-	typedef cppcomponents::runtime_class<easy_id, cppcomponents::object_interfaces<IEasy>> Easy_t;
+	typedef cppcomponents::runtime_class<easy_id, cppcomponents::object_interfaces<IEasy, IEasy2>> Easy_t;
 	typedef cppcomponents::use_runtime_class<Easy_t> Easy;
 
+	struct IEasyPool :cppcomponents::define_interface<cppcomponents::uuid<0x3f0c8a52, 0x6d1e, 0x4b7a, 0x9c43, 0x8e25d7a1b6f0>>
+	{
+		// Returns a reset handle, creating a new one only if no idle handle is available
+		cppcomponents::use<IEasy> Acquire();
+
+		// Resets the handle and keeps it for reuse. Handles acquired from a pool
+		// are released automatically by IMulti once the completion callback returns
+		void Release(cppcomponents::use<IEasy> easy);
+
+		// Number of idle handles
+		std::uint32_t Size();
+		// Number of handles acquired and not yet released
+		std::uint32_t Outstanding();
+		// Largest value Outstanding() has reached
+		std::uint32_t HighWater();
+		// Number of handles created by curl_easy_init
+		std::uint64_t Created();
+
+		CPPCOMPONENTS_CONSTRUCT(IEasyPool, Acquire, Release, Size, Outstanding, HighWater, Created);
+	};
+
+	struct IEasyPoolFactory :cppcomponents::define_interface<cppcomponents::uuid<0x5b7e2d19, 0xa4c3, 0x4f86, 0xb1e0, 0x29d64c83f5a7>>
+	{
+		// max_idle is the number of idle handles kept, extra released handles are destroyed
+		cppcomponents::use<cppcomponents::InterfaceUnknown> Create(std::uint32_t max_idle);
+
+		CPPCOMPONENTS_CONSTRUCT(IEasyPoolFactory, Create);
+	};
+
+	inline std::string easypool_id(){ return "cppcomponents_libcurl_libuv_dll!EasyPool"; }
+	typedef cppcomponents::runtime_class<easypool_id, cppcomponents::object_interfaces<IEasyPool>,
+		cppcomponents::factory_interface<IEasyPoolFactory>> EasyPool_t;
+	typedef cppcomponents::use_runtime_class<EasyPool_t> EasyPool;
+
+	// Where the time of a transfer went. Times are seconds from the start of the
+	// transfer as curl_easy_getinfo reports them, except QueueWait which is spent
+	// in the multi before the transfer starts
+	struct ResponseTimings{
+		double QueueWait;
+		double NameLookup;
+		double Connect;
+		// TLS handshake done, 0 without TLS
+		double AppConnect;
+		// First byte received
+		double StartTransfer;
+		double Total;
+		double BytesUploaded;
+		double BytesDownloaded;
+		// False too if the transfer failed before it had a connection
+		bool ConnectionReused;
+	};
+
+	// Positions in IResponse2::TimingValues. ConnectionReused is 1 or 0, or -1
+	// if the transfer failed before it had a connection
+	namespace TimingValue{
+		enum{
+			QueueWait, NameLookup, Connect, AppConnect, StartTransfer, Total,
+			BytesUploaded, BytesDownloaded, ConnectionReused, Count
+		};
+	}
+
+	// Implemented by Response, query it from the IResponse
+	struct IResponse2 :cppcomponents::define_interface<cppcomponents::uuid<0x1d7f5b82, 0xc3a9, 0x4e16, 0x8b5d, 0x62e0a4f9c317>>
+	{
+		// Captured at completion, so it stays valid after a pooled handle is reused
+		std::int32_t StatusCode();
+
+		// The body as received, without copying it into one contiguous block.
+		// Body() flattens the segments on first use if there is more than one
+		std::vector<cppcomponents::use<cppcomponents::IBuffer>> BodyBuffers();
+		std::uint64_t BodySize();
+
+		// Case-insensitive lookup of the last header with this name, the value has
+		// surrounding whitespace removed. Empty if there is no such header
+		// The returned strings are valid as long as the response
+		cppcomponents::cr_string Header(cppcomponents::cr_string name);
+
+		// Index based access to Headers() without copying
+		std::uint32_t HeaderCount();
+		cppcomponents::cr_string HeaderName(std::uint32_t index);
+		cppcomponents::cr_string HeaderValue(std::uint32_t index);
+
+		// Seconds the transfer waited in the multi before it started, captured at completion
+		double QueueTime();
+
+		// Indexed by TimingValue, captured when the transfer completes. Use Timings()
+		std::vector<double> TimingValues();
+
+		CPPCOMPONENTS_CONSTRUCT(IResponse2, StatusCode, BodyBuffers, BodySize, Header, HeaderCount, HeaderName,
+			HeaderValue, QueueTime, TimingValues);
+
+		CPPCOMPONENTS_INTERFACE_EXTRAS(IResponse2){
+			ResponseTimings Timings(){
+				auto v = this->get_interface().TimingValues();
+				ResponseTimings t = {};
+				if (v.size() < TimingValue::Count){
+					return t;
+				}
+				t.QueueWait = v[TimingValue::QueueWait];
+				t.NameLookup = v[TimingValue::NameLookup];
+				t.Connect = v[TimingValue::Connect];
+				t.AppConnect = v[TimingValue::AppConnect];
+				t.StartTransfer = v[TimingValue::StartTransfer];
+				t.Total = v[TimingValue::Total];
+				t.BytesUploaded = v[TimingValue::BytesUploaded];
+				t.BytesDownloaded = v[TimingValue::BytesDownloaded];
+				t.ConnectionReused = v[TimingValue::ConnectionReused] > 0;
+				return t;
+			}
+		};
+	};
+
 	struct IResponse :cppcomponents::define_interface<cppcomponents::uuid<0xd919e330, 0x7ec6, 0x4e7a, 0xa6a7, 0xaedf0b98dc73>>
 	{
 		cppcomponents::error_code ErrorCode();
@@ -98,7 +259,12 @@ namespace cppcomponents_libcurl_libuv{
 		CPPCOMPONENTS_CONSTRUCT(IResponse, ErrorCode, ErrorMessage, Request, Body, Headers);
 
 		CPPCOMPONENTS_INTERFACE_EXTRAS(IResponse){
+			// Responses that implement IResponse2 keep the code captured at completion
 			std::int32_t ResponseCode(){
+				auto r2 = this->get_interface().template QueryInterfaceNoThrow<IResponse2>();
+				if (r2){
+					return r2.StatusCode();
+				}
 				return this->get_interface().Request().GetInt32Info(Constants::Info::CURLINFO_RESPONSE_CODE);
 			}
 
@@ -117,6 +283,21 @@ namespace cppcomponents_libcurl_libuv{
 
 	};
 
+	// Implemented by Response, query it from the IResponseWriter
+	struct IResponseWriter2 :cppcomponents::define_interface<cppcomponents::uuid<0x6b3e0d94, 0x7a1c, 0x4f25, 0x9e87, 0xd4c2f61a05b9>>
+	{
+		// Called from the completion callback, records ec and copies the response code
+		// and error description out of the handle
+		void Complete(cppcomponents::error_code ec);
+
+		// Completes a response that did not come from a transfer, such as one served
+		// from a cache. The body buffers are shared, not copied
+		void CompleteFrom(std::int32_t response_code, std::vector<std::pair<std::string, std::string>> headers,
+			std::vector<cppcomponents::use<cppcomponents::IBuffer>> body);
+
+		CPPCOMPONENTS_CONSTRUCT(IResponseWriter2, Complete, CompleteFrom);
+	};
+
 	struct IResponseFactory :cppcomponents::define_interface<cppcomponents::uuid<0x71163bc4, 0x95ba, 0x49f8, 0x9263, 0x28d366ab7467>>
 	{
 		cppcomponents::use<cppcomponents::InterfaceUnknown> Create(cppcomponents::use<IEasy>);
@@ -124,7 +305,8 @@ namespace cppcomponents_libcurl_libuv{
 		CPPCOMPONENTS_CONSTRUCT(IResponseFactory, Create);
 	};
 	inline std::string response_id(){ return "cppcomponents_libcurl_libuv_dll!Response"; }
-	typedef cppcomponents::runtime_class<response_id, cppcomponents::object_interfaces<IResponse,IResponseWriter>
+	typedef cppcomponents::runtime_class<response_id, cppcomponents::object_interfaces<IResponse,IResponseWriter,
+		IResponse2, IResponseWriter2>
 	,cppcomponents::factory_interface<IResponseFactory>> Response_t;
 	typedef cppcomponents::use_runtime_class<Response_t> Response;
 
@@ -132,8 +314,22 @@ namespace cppcomponents_libcurl_libuv{
 		typedef cppcomponents::delegate<void(cppcomponents::use<IEasy>, std::int32_t ec)> CompletedFunction;
 	}
 
+	// Limits of the scheduler in front of libcurl, set with IMulti2::SetInt32Option.
+	// Transfers over a limit wait in the multi, hosts take turns within each
+	// TransferPriority class
+	namespace SchedulerOptions{
+		enum{
+			// Transfers in progress, 0 for no limit
+			MaxActive = -1,
+			// Transfers in progress per host and port, 0 for no limit
+			MaxActivePerHost = -2
+		};
+	}
+
 	struct IMulti :cppcomponents::define_interface<cppcomponents::uuid<0xc05815c2, 0xef99, 0x40cb, 0xafe5, 0x35cafdefe834>>{
 		cppcomponents::Future<void> Add(cppcomponents::use<IEasy>,cppcomponents::use<Callbacks::CompletedFunction>);
+		// Cancels the transfer, its completion runs with CURLE_OK. Fails if the
+		// handle has already completed
 		cppcomponents::Future<void>  Remove(cppcomponents::use<IEasy>);
 		void* GetNative();
 
@@ -141,6 +337,315 @@ namespace cppcomponents_libcurl_libuv{
 
 	};
 
+	// Implemented by Multi and MultiGroup, query it from the IMulti
+	struct IMulti2 :cppcomponents::define_interface<cppcomponents::uuid<0xe57a2c19, 0x4b60, 0x4d8e, 0xa3f1, 0x8c9d06b2e47a>>{
+		// Every handle added after this call uses share, pass nullptr to stop sharing
+		// Fails if share shares connections and another multi uses it, so a
+		// MultiGroup of more than one multi cannot share connections
+		void SetShare(cppcomponents::use<IShare> share);
+
+		// Calls curl_easy_pause on the loop thread, bitmask is one of Constants::Pause
+		// Fails if the handle is not currently added to this multi
+		cppcomponents::Future<void> Pause(cppcomponents::use<IEasy>, std::int32_t bitmask);
+
+		// Adds all handles with a single hop to the loop thread. funcs[i] is the
+		// completion callback of easies[i]. A handle that cannot be added completes
+		// right away with CURLE_FAILED_INIT
+		cppcomponents::Future<void> AddMany(std::vector<cppcomponents::use<IEasy>> easies,
+			std::vector<cppcomponents::use<Callbacks::CompletedFunction>> funcs);
+
+		// Calls curl_multi_setopt on the loop thread, option is one of
+		// Constants::MultiOptions or SchedulerOptions
+		cppcomponents::Future<void> SetInt32Option(std::int32_t option, std::int32_t parameter);
+
+		// Add without a promise or future. A handle that cannot be added completes
+		// with CURLE_FAILED_INIT, on the calling thread if the loop could not be
+		// woken, so func is always called exactly once
+		void Start(cppcomponents::use<IEasy>, cppcomponents::use<Callbacks::CompletedFunction> func);
+
+		// Completes on the loop thread once milliseconds have passed
+		cppcomponents::Future<void> After(std::uint32_t milliseconds);
+
+		// Pause for transfer, a value of IEasy2::GetTransfer. Does nothing once
+		// that transfer is over, even if the handle is in another one
+		cppcomponents::Future<void> PauseTransfer(cppcomponents::use<IEasy>, std::uint64_t transfer, std::int32_t bitmask);
+
+		CPPCOMPONENTS_CONSTRUCT(IMulti2, SetShare, Pause, AddMany, SetInt32Option, Start, After, PauseTransfer);
+
+		CPPCOMPONENTS_INTERFACE_EXTRAS(IMulti2){
+			// mode is one of Constants::Pipelining, CURLPIPE_MULTIPLEX lets HTTP/2
+			// transfers to a host share a connection
+			cppcomponents::Future<void> SetPipelining(std::int32_t mode){
+				return this->get_interface().SetInt32Option(Constants::MultiOptions::CURLMOPT_PIPELINING, mode);
+			}
+			// 0 for no limit
+			cppcomponents::Future<void> SetMaxHostConnections(std::int32_t n){
+				return this->get_interface().SetInt32Option(Constants::MultiOptions::CURLMOPT_MAX_HOST_CONNECTIONS, n);
+			}
+			// 0 for no limit
+			cppcomponents::Future<void> SetMaxTotalConnections(std::int32_t n){
+				return this->get_interface().SetInt32Option(Constants::MultiOptions::CURLMOPT_MAX_TOTAL_CONNECTIONS, n);
+			}
+			// Size of the connection cache
+			cppcomponents::Future<void> SetMaxConnects(std::int32_t n){
+				return this->get_interface().SetInt32Option(Constants::MultiOptions::CURLMOPT_MAXCONNECTS, n);
+			}
+			cppcomponents::Future<void> SetMaxActive(std::int32_t n){
+				return this->get_interface().SetInt32Option(SchedulerOptions::MaxActive, n);
+			}
+			cppcomponents::Future<void> SetMaxActivePerHost(std::int32_t n){
+				return this->get_interface().SetInt32Option(SchedulerOptions::MaxActivePerHost, n);
+			}
+		};
+
+	};
+
+	// Log-linear histogram of microseconds in the style of HdrHistogram, each power
+	// of two is split into SubBuckets buckets, so a bucket is within 25% of its values
+	namespace Histogram{
+		enum{
+			SubBits = 2,
+			SubBuckets = 1 << SubBits,
+			// Up to about 2 hours, larger values go in the last bucket
+			Buckets = 32 * SubBuckets
+		};
+
+		inline std::uint32_t BucketIndex(std::uint64_t micros){
+			if (micros < SubBuckets){
+				return static_cast<std::uint32_t>(micros);
+			}
+			std::uint32_t e = SubBits;
+			while (e < 63 && (micros >> (e + 1))){
+				++e;
+			}
+			auto index = (e - SubBits + 1) * SubBuckets + static_cast<std::uint32_t>((micros >> (e - SubBits)) & (SubBuckets - 1));
+			return index < Buckets ? index : Buckets - 1;
+		}
+
+		inline std::uint64_t BucketLowerBound(std::uint32_t index){
+			if (index < SubBuckets){
+				return index;
+			}
+			auto e = index / SubBuckets - 1 + SubBits;
+			return static_cast<std::uint64_t>(SubBuckets + index % SubBuckets) << (e - SubBits);
+		}
+
+		inline std::uint64_t Total(const std::vector<std::uint64_t>& buckets){
+			std::uint64_t total = 0;
+			for (auto c : buckets){
+				total += c;
+			}
+			return total;
+		}
+
+		// Lower bound of the bucket holding the q quantile, 0 <= q <= 1
+		inline std::uint64_t Percentile(const std::vector<std::uint64_t>& buckets, double q){
+			auto total = Total(buckets);
+			if (total == 0){
+				return 0;
+			}
+			auto rank = static_cast<std::uint64_t>(q * static_cast<double>(total - 1)) + 1;
+			std::uint64_t seen = 0;
+			for (std::uint32_t i = 0; i < buckets.size(); ++i){
+				seen += buckets[i];
+				if (seen >= rank){
+					return BucketLowerBound(i);
+				}
+			}
+			return BucketLowerBound(static_cast<std::uint32_t>(buckets.size() - 1));
+		}
+	}
+
+	// Positions in IMultiStats::Counters
+	namespace MultiCounter{
+		enum{
+			// Gauges, not cleared by Reset
+			Running, Waiting, SubmitDepth,
+			// Since the last Reset. Cancelled counts the transfers Remove took out
+			// of the multi, they are not Completed or Failed and stay out of the
+			// latency histograms
+			Added, Completed, Failed, Cancelled, BytesDownloaded, BytesUploaded,
+			SocketActions, SocketActionMicros, InfoReadDrains, InfoReadMessages,
+			Drains, Drained, SubmitDepthHigh, DrainBatchHigh, MicrosSinceReset,
+			Count
+		};
+	}
+
+	// Status classes of IMultiStats::LatencyHistogram, the others are the
+	// first digit of the HTTP response code
+	namespace StatusClass{
+		enum{
+			// The transfer failed before a response arrived
+			Failed = 0,
+			Count = 6
+		};
+	}
+
+	// Implemented by Multi, query it from the IMulti. Counters and histograms are
+	// updated on the loop thread with relaxed atomics, reading them from another
+	// thread gives a consistent enough snapshot without stopping the loop
+	struct IMultiStats :cppcomponents::define_interface<cppcomponents::uuid<0x5b0e3f61, 0x2d7c, 0x4a18, 0x9e43, 0xc1f6a8d27b95>>
+	{
+		// Indexed by MultiCounter
+		std::vector<std::uint64_t> Counters();
+
+		// End to end latency, queue wait included, of transfers by StatusClass
+		std::vector<std::uint64_t> LatencyHistogram(std::int32_t status_class);
+
+		// Time spent in each curl_multi_socket_action call
+		std::vector<std::uint64_t> SocketActionHistogram();
+
+		// Latency by host. The first hosts seen get their own histogram, the rest
+		// share the last one, named "*"
+		std::uint32_t HostCount();
+		std::string HostName(std::uint32_t index);
+		std::vector<std::uint64_t> HostLatencyHistogram(std::uint32_t index);
+
+		void Reset();
+
+		// Microseconds, the q quantile of the latency to the host of url, 0 if
+		// nothing was recorded for it
+		std::uint64_t HostPercentile(cppcomponents::cr_string url, double q);
+
+		CPPCOMPONENTS_CONSTRUCT(IMultiStats, Counters, LatencyHistogram, SocketActionHistogram,
+			HostCount, HostName, HostLatencyHistogram, Reset, HostPercentile);
+
+		CPPCOMPONENTS_INTERFACE_EXTRAS(IMultiStats){
+			// Bytes per second since the last Reset, downloaded and uploaded
+			std::pair<double, double> Throughput(){
+				auto c = this->get_interface().Counters();
+				auto seconds = static_cast<double>(c[MultiCounter::MicrosSinceReset]) / 1e6;
+				if (seconds <= 0){
+					return std::make_pair(0.0, 0.0);
+				}
+				return std::make_pair(c[MultiCounter::BytesDownloaded] / seconds, c[MultiCounter::BytesUploaded] / seconds);
+			}
+		};
+	};
+
+	namespace MultiGroupPolicy{
+		enum{
+			// Each Add goes to the multi with the fewest transfers in progress
+			LeastOutstanding = 0,
+			// Transfers to the same host always go to the same multi, so connections are reused
+			HostAffinity = 1
+		};
+	}
+
+	struct IMultiGroup :cppcomponents::define_interface<cppcomponents::uuid<0x8d4b7f03, 0x1ea6, 0x4c92, 0xa57d, 0xe0c39b6a2418>>
+	{
+		std::uint32_t Size();
+		cppcomponents::use<IMulti> GetMulti(std::uint32_t index);
+		std::int32_t Outstanding(std::uint32_t index);
+
+		CPPCOMPONENTS_CONSTRUCT(IMultiGroup, Size, GetMulti, Outstanding);
+	};
+
+	struct IMultiGroupFactory :cppcomponents::define_interface<cppcomponents::uuid<0x46e1a9c8, 0x7b25, 0x4d3f, 0x8c6e, 0x5f92d0b7a143>>
+	{
+		// Creates threads multis, each with its own loop thread. threads == 0 uses
+		// the number of hardware threads. policy is one of MultiGroupPolicy
+		cppcomponents::use<cppcomponents::InterfaceUnknown> Create(std::uint32_t threads, std::int32_t policy);
+
+		CPPCOMPONENTS_CONSTRUCT(IMultiGroupFactory, Create);
+	};
+
+	// IMulti::GetNative returns nullptr, use GetMulti to reach an individual multi handle
+	inline std::string multigroup_id(){ return "cppcomponents_libcurl_libuv_dll!MultiGroup"; }
+	typedef cppcomponents::runtime_class<multigroup_id, cppcomponents::object_interfaces<IMulti, IMulti2, IMultiGroup>,
+		cppcomponents::factory_interface<IMultiGroupFactory>> MultiGroup_t;
+	typedef cppcomponents::use_runtime_class<MultiGroup_t> MultiGroup;
+
+	// Positions in IResponseCache::Counters
+	namespace CacheCounter{
+		enum{
+			// Served fresh without contacting the server
+			Hits,
+			// Nothing was cached for the key
+			Misses,
+			// A stale entry was confirmed by a 304
+			Revalidated,
+			// A stale entry was replaced by the server's new response
+			RevalidationChanged,
+			Stores,
+			// Entries dropped to stay within the byte budget
+			Evictions,
+			// Gauges
+			Entries, Bytes,
+			Count
+		};
+	}
+
+	// Responses kept in memory by key, usually the url of a GET. The cache is
+	// split into shards, each with its own lock, LRU list and share of the byte
+	// budget. Freshness comes from Cache-Control max-age, or Expires, less Age.
+	// no-cache and responses with only a validator are stored but always
+	// revalidated. no-store, Vary and error responses are not stored. Only the
+	// headers of the last response of a redirect chain are looked at and kept
+	struct IResponseCache :cppcomponents::define_interface<cppcomponents::uuid<0xb3283c6e, 0xb9d6, 0x43e0, 0x9c2c, 0x41eaf1dda6d4>>
+	{
+		// A response with the entry for key if it is fresh, otherwise null. The
+		// response shares the body buffers of the entry
+		cppcomponents::use<IResponse> GetFresh(cppcomponents::cr_string key);
+
+		// The entry for key even if it is stale, null if there is none. Revalidate
+		// it by sending its ETag as If-None-Match and Last-Modified as
+		// If-Modified-Since
+		cppcomponents::use<IResponse> GetStale(cppcomponents::cr_string key);
+
+		// Stores response if it can be cached and returns the response to give to
+		// the caller. stale is what GetStale returned when the request was made, or
+		// null. A 304 refreshes stale with the headers of response and returns it
+		cppcomponents::use<IResponse> Update(cppcomponents::cr_string key, cppcomponents::use<IResponse> response,
+			cppcomponents::use<IResponse> stale);
+
+		void Remove(cppcomponents::cr_string key);
+		void Clear();
+
+		// Indexed by CacheCounter
+		std::vector<std::uint64_t> Counters();
+
+		CPPCOMPONENTS_CONSTRUCT(IResponseCache, GetFresh, GetStale, Update, Remove, Clear, Counters);
+	};
+
+	struct IResponseCacheFactory :cppcomponents::define_interface<cppcomponents::uuid<0x92a1d61b, 0x751a, 0x4a0f, 0xb22a, 0x74087efeac0c>>
+	{
+		// max_bytes is shared evenly by the shards, shards == 0 uses 16
+		cppcomponents::use<cppcomponents::InterfaceUnknown> Create(std::uint64_t max_bytes, std::uint32_t shards);
+
+		CPPCOMPONENTS_CONSTRUCT(IResponseCacheFactory, Create);
+	};
+
+	inline std::string responsecache_id(){ return "cppcomponents_libcurl_libuv_dll!ResponseCache"; }
+	typedef cppcomponents::runtime_class<responsecache_id, cppcomponents::object_interfaces<IResponseCache>,
+		cppcomponents::factory_interface<IResponseCacheFactory>> ResponseCache_t;
+	typedef cppcomponents::use_runtime_class<ResponseCache_t> ResponseCache;
+
+	struct IDiskResponseCacheFactory :cppcomponents::define_interface<cppcomponents::uuid<0x4e7d2a90, 0x3c51, 0x4b8f, 0xa6e2, 0x9d03f15c7b28>>
+	{
+		// Opens the cache kept in directory, which must exist, or starts an empty
+		// one. max_bytes bounds the segment files
+		cppcomponents::use<cppcomponents::InterfaceUnknown> Create(cppcomponents::cr_string directory, std::uint64_t max_bytes);
+
+		CPPCOMPONENTS_CONSTRUCT(IDiskResponseCacheFactory, Create);
+	};
+
+	// A ResponseCache that outlives the process, for large responses fetched
+	// again after restarts. Records are appended to segment files that are read
+	// through memory maps, the body of a hit points into the map instead of
+	// being copied, and the oldest segment is deleted when over budget.
+	// An index of key hashes written next to the segments lets a new process
+	// start without reading the records. Only records appended since the index
+	// was last written are scanned. Records are written by a thread of the
+	// cache's own, so a stored response can be found once it was written, and
+	// stores are dropped while that thread is a segment behind. The files use
+	// the byte order of the machine that wrote them. Only one process may use a
+	// directory at a time
+	inline std::string diskresponsecache_id(){ return "cppcomponents_libcurl_libuv_dll!DiskResponseCache"; }
+	typedef cppcomponents::runtime_class<diskresponsecache_id, cppcomponents::object_interfaces<IResponseCache>,
+		cppcomponents::factory_interface<IDiskResponseCacheFactory>> DiskResponseCache_t;
+	typedef cppcomponents::use_runtime_class<DiskResponseCache_t> DiskResponseCache;
+
 	struct ICurlStatics : cppcomponents::define_interface<cppcomponents::uuid<0x97460a91, 0x62f8, 0x4788, 0x8ba9, 0x7a3d162b5a03>>{
 		std::string Escape(cppcomponents::cr_string url);
 		std::string UnEscape(cppcomponents::cr_string url);
@@ -152,8 +657,18 @@ namespace cppcomponents_libcurl_libuv{
 
 	};
 
+	struct ICurlStatics2 : cppcomponents::define_interface<cppcomponents::uuid<0x3f8d6b21, 0xc47e, 0x4a19, 0x9b53, 0x1e07a4d2c985>>{
+		// operator new calls made inside the dll, for benchmarks. On Windows the
+		// dll has an operator new of its own that the program's cannot see, so
+		// it counts them. Elsewhere the program's operator new sees them, and
+		// this is always 0
+		std::uint64_t Allocations();
+
+		CPPCOMPONENTS_CONSTRUCT(ICurlStatics2, Allocations);
+	};
+
 	inline std::string curlstatics_id(){ return "cppcomponents_libcurl_libuv_dll!Curl"; }
-	typedef cppcomponents::runtime_class<curlstatics_id, cppcomponents::static_interfaces<ICurlStatics>> Curl_t;
+	typedef cppcomponents::runtime_class<curlstatics_id, cppcomponents::static_interfaces<ICurlStatics, ICurlStatics2>> Curl_t;
 	typedef cppcomponents::use_runtime_class<Curl_t> Curl;
 
 
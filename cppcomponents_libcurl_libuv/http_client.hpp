@@ -4,6 +4,14 @@
 
 
 #include "cppcomponents_libcurl_libuv.hpp"
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <fstream>
+#include <cctype>
+#include <unordered_map>
+#include <algorithm>
+#include <random>
 
 namespace cppcomponents_libcurl_libuv{
 
@@ -14,6 +22,17 @@ namespace cppcomponents_libcurl_libuv{
 		std::string Method;
 		std::vector<std::pair<std::string, std::string>> Headers;
 		std::string Body;
+		// Sent without copying instead of Body when not empty. The buffers must not
+		// be modified until the fetch completes
+		std::vector<cppcomponents::use<cppcomponents::IBuffer>> BodyBuffers;
+		// PUT or POST body read from this file as the transfer goes, instead of Body
+		std::string UploadFile;
+		// PUT or POST body read from this channel as the transfer goes, the transfer is
+		// paused while the channel is empty. Write an empty buffer to end the body,
+		// closing the channel or writing an error aborts the transfer
+		cppcomponents::Channel<cppcomponents::use<cppcomponents::IBuffer>> UploadChannel;
+		// Size of the UploadChannel body if known, otherwise chunked encoding is used
+		std::int64_t UploadSize = -1;
 		std::string Username;
 		std::string Password;
 		std::int32_t AuthMode = 0;
@@ -38,6 +57,37 @@ namespace cppcomponents_libcurl_libuv{
 		std::string Referer;
 		std::string Cookie;
 		std::string CookieFile;
+		// One of Constants::HttpVersion, 0 lets libcurl choose
+		std::int32_t HttpVersion = 0;
+		// Wait for a connection that can multiplex this request instead of opening
+		// another one, requires libcurl 7.43.0 or later
+		bool PipeWait = false;
+		// One of TransferPriority, used when the multi has to queue transfers
+		std::int32_t Priority = TransferPriority::Normal;
+		// Where the response future is fulfilled, or the Start callback run, once
+		// the transfer is done. Null runs it inline on the loop thread, which is
+		// cheapest for light handlers. Use a LoopExecutor or a thread pool for
+		// handlers that would hold up socket processing
+		cppcomponents::use<cppcomponents::IExecutor> CompletionExecutor;
+		// Milliseconds after which a plain GET still waiting for its response gets
+		// a second identical transfer, and completes with whichever finishes first.
+		// Only used by clients with a HedgeBudget, 0 does not hedge
+		std::uint32_t HedgeDelay = 0;
+		// Hedge after the 95th percentile latency the multi has seen for the host
+		// instead. HedgeDelay is used until there is one, and always on a
+		// MultiGroup, which keeps no IMultiStats
+		bool HedgeAtHostP95 = false;
+		// Attempts after the first when the transfer fails with one of RetryErrors
+		// or the response has one of RetryStatuses, 0 does not retry. POSTs,
+		// requests with channels and hedged requests are not retried
+		std::uint32_t MaxRetries = 0;
+		// Constants::Errors values, as IResponse::ErrorCode reports them
+		std::vector<std::int32_t> RetryErrors;
+		std::vector<std::int32_t> RetryStatuses;
+		// Milliseconds before the first retry, doubled for each retry after it up to
+		// RetryMaxDelay. Each wait is picked at random from the upper half
+		std::uint32_t RetryBaseDelay = 100;
+		std::uint32_t RetryMaxDelay = 10000;
 
 
 
@@ -45,6 +95,13 @@ namespace cppcomponents_libcurl_libuv{
 		cppcomponents::Channel<cppcomponents::use<cppcomponents::IBuffer>> HeaderChannel;
 		cppcomponents::Channel<std::tuple<double, double, double, double>> ProgressChannel;
 
+		// Data for StreamingChannel is coalesced into buffers of this size,
+		// 0 writes each chunk as libcurl delivers it
+		std::size_t StreamingChunkSize = 0;
+		// The transfer is paused while this many buffers written to StreamingChannel
+		// have not been read, 0 for no limit
+		std::size_t MaxStreamingBuffersInFlight = 0;
+
 
 
 		Request(){ Initialize(); }
@@ -54,172 +111,859 @@ namespace cppcomponents_libcurl_libuv{
 	private:
 		void Initialize(){
 			CACerts = "cacert.pem";
+			RetryErrors = std::vector<std::int32_t>{ Constants::Errors::CURLE_COULDNT_CONNECT, Constants::Errors::CURLE_OPERATION_TIMEDOUT,
+				Constants::Errors::CURLE_GOT_NOTHING, Constants::Errors::CURLE_SEND_ERROR, Constants::Errors::CURLE_RECV_ERROR };
+			RetryStatuses = std::vector<std::int32_t>{ 429, 502, 503, 504 };
+		}
+	};
+
+	// Options that do not depend on the url, method or body of a request
+	inline void ApplyCommonOptions(cppcomponents::use<IEasy> easy, const Request& req){
+		// Handle headers
+		bool chunked_post = req.Method == "POST" && req.UploadChannel && req.UploadSize < 0;
+		if (!req.Headers.empty() || chunked_post){
+			Slist sl;
+			for (auto& p : req.Headers){
+				sl.Append(p.first + ':' + p.second);
+			}
+			if (chunked_post){
+				// libcurl only sends a POST of unknown size with chunked encoding if asked to
+				sl.Append("Transfer-Encoding: chunked");
+			}
+			easy.SetPointerOption(Constants::Options::CURLOPT_HTTPHEADER, sl.get_portable_base());
+		}
+
+		// Rest of options handled alphabetically
+		//#define CURL_IPRESOLVE_WHATEVER 0 default, resolves addresses to all IP
+		//			versions that your system allows 
+		//#define CURL_IPRESOLVE_V4       1 /* resolve to ipv4 addresses 
+		//#define CURL_IPRESOLVE_V6       2 /* resolve to ipv6 addresses 
+		if (req.AllowIPv6){
+			easy.SetInt32Option(Constants::Options::CURLOPT_IPRESOLVE, 1);
+		}
+		else{
+			easy.SetInt32Option(Constants::Options::CURLOPT_IPRESOLVE, 0);
+		}
+
+		easy.SetInt32Option(Constants::Options::CURLOPT_HTTPAUTH, req.AuthMode);
+
+		if (req.CACerts.size()){
+			easy.SetStringOption(Constants::Options::CURLOPT_CAINFO, req.CACerts);
+		}
+
+		if (req.ClientCert.size()){
+			easy.SetStringOption(Constants::Options::CURLOPT_SSLCERT, req.ClientCert);
+		}
+		if (req.ClientKey.size()){
+			easy.SetStringOption(Constants::Options::CURLOPT_KEYPASSWD, req.ClientKey);
+
+		}
+		if (req.ConnectTimeout != 0){
+			easy.SetInt32Option(Constants::Options::CURLOPT_CONNECTTIMEOUT_MS, req.ConnectTimeout);
+		}
+		if (req.Cookie.size()){
+			easy.SetStringOption(Constants::Options::CURLOPT_COOKIE, req.Cookie);
+		}
+		if (req.CookieFile.size()){
+			easy.SetStringOption(Constants::Options::CURLOPT_COOKIEFILE, req.CookieFile);
+		}
+
+		easy.SetInt32Option(Constants::Options::CURLOPT_FOLLOWLOCATION, req.FollowRedirects ? 1 : 0);
+
+		if (req.HttpVersion != 0){
+			easy.SetInt32Option(Constants::Options::CURLOPT_HTTP_VERSION, req.HttpVersion);
+		}
+
+		if (req.MaxRedirects != 0){
+			easy.SetInt32Option(Constants::Options::CURLOPT_MAXREDIRS, req.MaxRedirects);
+		}
+
+		if (req.NetworkInterface.size()){
+			easy.SetStringOption(Constants::Options::CURLOPT_INTERFACE, req.NetworkInterface);
+		}
+
+		if (req.Password.size()){
+			easy.SetStringOption(Constants::Options::CURLOPT_PASSWORD, req.Password);
+		}
+
+		if (req.PipeWait){
+			easy.SetInt32Option(Constants::Options::CURLOPT_PIPEWAIT, 1);
+		}
+
+		if (req.ProxyHost.size()){
+			easy.SetStringOption(Constants::Options::CURLOPT_PROXY, req.ProxyHost);
+		}
+
+		if (req.ProxyPort != 0){
+			easy.SetInt32Option(Constants::Options::CURLOPT_PROXYPORT, req.ProxyPort);
+		}
+
+		if (req.ProxyPassword.size()){
+			easy.SetStringOption(Constants::Options::CURLOPT_PROXYPASSWORD, req.ProxyPassword);
+		}
+		if (req.ProxyUsername.size()){
+			easy.SetStringOption(Constants::Options::CURLOPT_PROXYUSERNAME, req.ProxyUsername);
+		}
+		if (req.Referer.size()){
+			easy.SetStringOption(Constants::Options::CURLOPT_REFERER, req.Referer);
+		}
+
+		if (req.RequestTimeout != 0){
+			easy.SetInt32Option(Constants::Options::CURLOPT_TIMEOUT_MS, req.RequestTimeout);
+		}
+
+		if (req.UseGzip){
+			easy.SetStringOption(Constants::Options::CURLOPT_ACCEPT_ENCODING, "");
+		}
+		if (req.UserAgent.size()){
+			easy.SetStringOption(Constants::Options::CURLOPT_USERAGENT, req.UserAgent);
+		}
+		if (req.Username.size()){
+			easy.SetStringOption(Constants::Options::CURLOPT_USERNAME, req.Username);
+		}
+
+		easy.SetInt32Option(Constants::Options::CURLOPT_SSL_VERIFYHOST, req.ValidateCert ? 2 : 0);
+	}
+
+	// Applies the common options of a Request once to a prototype handle. Each fetch
+	// copies the prototype with curl_easy_duphandle, so only the url, method, body
+	// and callbacks are set per request. Handles made from a template are not pooled
+	class RequestTemplate{
+		mutable cppcomponents::use<IEasy> prototype_;
+		Request request_;
+
+	public:
+		RequestTemplate(const Request& req) :prototype_{ Easy{} }, request_(req){
+			prototype_.Reset();
+			ApplyCommonOptions(prototype_, req);
+		}
+
+		const Request& GetRequest() const{
+			return request_;
+		}
+
+		cppcomponents::use<IEasy> Create() const{
+			return prototype_.QueryInterface<IEasy2>().Duplicate();
 		}
 	};
+
+	class Batch;
+
+	struct HttpClient;
+
+	// Lets concurrent identical GETs share one transfer. A fetch that finds the
+	// same request in flight waits for it instead of starting another, and gets
+	// its own response object sharing the body buffers of that transfer. Copies
+	// share the set of requests in flight
+	class SingleFlight{
+		typedef decltype(cppcomponents::make_promise<cppcomponents::use<IResponse>>()) ResponsePromise;
+
+		struct State{
+			std::mutex mut_;
+			// The waiters of each request in flight, the fetch that started it is not included
+			std::unordered_map<std::string, std::vector<ResponsePromise>> in_flight_;
+			std::vector<std::string> vary_;
+			std::atomic<std::uint64_t> started_;
+			std::atomic<std::uint64_t> coalesced_;
+
+			State() :started_{ 0 }, coalesced_{ 0 }{}
+		};
+		std::shared_ptr<State> state_;
+
+		static bool iequals(const std::string& a, const std::string& b){
+			if (a.size() != b.size()){
+				return false;
+			}
+			for (std::size_t i = 0; i < a.size(); ++i){
+				if (std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i]))){
+					return false;
+				}
+			}
+			return true;
+		}
+
+		std::string KeyOf(const Request& req) const{
+			return Key(req, state_->vary_);
+		}
+
+		// A future for the request in flight with this key, or null if there is
+		// none and the caller must start it and call Finish
+		cppcomponents::Future<cppcomponents::use<IResponse>> Join(const std::string& key){
+			std::unique_lock<std::mutex> lock{ state_->mut_ };
+			auto iter = state_->in_flight_.find(key);
+			if (iter == state_->in_flight_.end()){
+				state_->in_flight_[key];
+				++state_->started_;
+				return nullptr;
+			}
+			auto promise = cppcomponents::make_promise<cppcomponents::use<IResponse>>();
+			iter->second.push_back(promise);
+			++state_->coalesced_;
+			return promise.QueryInterface<cppcomponents::IFuture<cppcomponents::use<IResponse>>>();
+		}
+
+		std::vector<ResponsePromise> TakeWaiters(const std::string& key){
+			std::vector<ResponsePromise> waiters;
+			std::unique_lock<std::mutex> lock{ state_->mut_ };
+			auto iter = state_->in_flight_.find(key);
+			if (iter != state_->in_flight_.end()){
+				waiters.swap(iter->second);
+				state_->in_flight_.erase(iter);
+			}
+			return waiters;
+		}
+
+		// The request could not be started
+		void Fail(const std::string& key, cppcomponents::error_code ec){
+			for (auto& w : TakeWaiters(key)){
+				w.SetError(ec);
+			}
+		}
+
+		// A response of its own for each waiter. Error responses have no body and
+		// are only read, so they are shared as they are
+		static cppcomponents::use<IResponse> Share(cppcomponents::use<IResponse> response){
+			if (response.ErrorCode() < 0){
+				return response;
+			}
+			Response copy{ cppcomponents::use<IEasy>{} };
+			copy.QueryInterface<IResponseWriter2>().CompleteFrom(response.ResponseCode(), response.Headers(),
+				response.QueryInterface<IResponse2>().BodyBuffers());
+			return copy.QueryInterface<IResponse>();
+		}
+
+		void Finish(const std::string& key, cppcomponents::Future<cppcomponents::use<IResponse>>& f, ResponsePromise& promise){
+			auto waiters = TakeWaiters(key);
+			if (f.ErrorCode() < 0){
+				for (auto& w : waiters){
+					w.SetError(f.ErrorCode());
+				}
+				promise.SetError(f.ErrorCode());
+				return;
+			}
+			auto response = f.Get();
+			// Copy before anyone can use the response
+			std::vector<cppcomponents::use<IResponse>> copies;
+			std::vector<cppcomponents::error_code> errors;
+			for (std::size_t i = 0; i < waiters.size(); ++i){
+				try{
+					copies.push_back(Share(response));
+					errors.push_back(0);
+				}
+				catch (std::exception& e){
+					copies.push_back(nullptr);
+					errors.push_back(cppcomponents::error_mapper::error_code_from_exception(e));
+				}
+			}
+			promise.Set(response);
+			for (std::size_t i = 0; i < waiters.size(); ++i){
+				if (errors[i] < 0){
+					waiters[i].SetError(errors[i]);
+				}
+				else{
+					waiters[i].Set(copies[i]);
+				}
+			}
+		}
+
+		friend struct HttpClient;
+
+	public:
+		// Requests share a transfer if they have the same key. It holds the url,
+		// the options that change the response, such as credentials, cookies,
+		// redirects, proxy, client certificate, HTTP version, Referer and timeouts,
+		// and the request headers. A non-empty vary leaves out the headers it does
+		// not name, except Authorization and Cookie
+		static std::string Key(const Request& req, const std::vector<std::string>& vary){
+			std::string key = "GET";
+			// Length prefixed, so no value can pass for two
+			auto field = [&key](const std::string& s){
+				key.push_back('\n');
+				key += std::to_string(s.size());
+				key.push_back(':');
+				key += s;
+			};
+			auto number = [&field](std::int64_t n){
+				field(std::to_string(n));
+			};
+			field(req.Url);
+			field(req.Username);
+			field(req.Password);
+			number(req.AuthMode);
+			field(req.Cookie);
+			field(req.CookieFile);
+			number(req.FollowRedirects);
+			number(req.MaxRedirects);
+			field(req.UserAgent);
+			number(req.UseGzip);
+			field(req.NetworkInterface);
+			field(req.ProxyHost);
+			number(req.ProxyPort);
+			field(req.ProxyUsername);
+			field(req.ProxyPassword);
+			number(req.ValidateCert);
+			field(req.CACerts);
+			number(req.AllowIPv6);
+			field(req.ClientKey);
+			field(req.ClientCert);
+			field(req.Referer);
+			number(req.HttpVersion);
+			number(req.ConnectTimeout);
+			number(req.RequestTimeout);
+			std::vector<std::string> headers;
+			for (auto& h : req.Headers){
+				bool keyed = vary.empty() || iequals(h.first, "Authorization") || iequals(h.first, "Cookie");
+				for (std::size_t i = 0; !keyed && i < vary.size(); ++i){
+					keyed = iequals(h.first, vary[i]);
+				}
+				if (keyed){
+					auto name = h.first;
+					std::transform(name.begin(), name.end(), name.begin(), [](char c){
+						return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+					});
+					headers.push_back(name + ':' + h.second);
+				}
+			}
+			// Header order does not matter
+			std::sort(headers.begin(), headers.end());
+			number(static_cast<std::int64_t>(headers.size()));
+			for (auto& h : headers){
+				field(h);
+			}
+			return key;
+		}
+
+		// Requests only share a transfer if the request headers named in
+		// vary_headers are equal, the others are not compared
+		explicit SingleFlight(std::vector<std::string> vary_headers) :state_{ std::make_shared<State>() }{
+			state_->vary_ = std::move(vary_headers);
+		}
+		// Requests only share a transfer if all their headers are equal
+		SingleFlight() :state_{ std::make_shared<State>() }{}
+
+		// Turns coalescing off
+		SingleFlight(std::nullptr_t){}
+
+		explicit operator bool() const{
+			return state_ != nullptr;
+		}
+
+		// Fetches that started a transfer, and fetches that waited for one instead
+		std::uint64_t Started() const{
+			return state_->started_;
+		}
+		std::uint64_t Coalesced() const{
+			return state_->coalesced_;
+		}
+	};
+
+	// Caps hedged requests at a fraction of the requests that could have been
+	// hedged. Copies share the budget and counts
+	class HedgeBudget{
+		struct State{
+			double max_extra_;
+			std::atomic<std::uint64_t> requests_;
+			std::atomic<std::uint64_t> hedged_;
+			std::atomic<std::uint64_t> won_;
+			std::atomic<std::uint64_t> denied_;
+
+			State(double max_extra) :max_extra_{ max_extra }, requests_{ 0 }, hedged_{ 0 }, won_{ 0 }, denied_{ 0 }{}
+		};
+		std::shared_ptr<State> state_;
+
+		void Track(){
+			++state_->requests_;
+		}
+
+		// Takes one hedge out of the budget if there is room for it
+		bool TryHedge(){
+			auto hedged = state_->hedged_.load();
+			for (;;){
+				auto allowed = state_->max_extra_ * static_cast<double>(state_->requests_.load());
+				if (static_cast<double>(hedged + 1) > allowed){
+					++state_->denied_;
+					return false;
+				}
+				if (state_->hedged_.compare_exchange_weak(hedged, hedged + 1)){
+					return true;
+				}
+			}
+		}
+
+		void RecordWin(){
+			++state_->won_;
+		}
+
+		friend struct HttpClient;
+
+	public:
+		// max_extra is the most extra load hedging may add, 0.05 allows one hedge
+		// for every 20 requests
+		explicit HedgeBudget(double max_extra) :state_{ std::make_shared<State>(max_extra) }{
+			if (!(max_extra >= 0)){
+				throw cppcomponents::error_invalid_arg();
+			}
+		}
+
+		// Turns hedging off
+		HedgeBudget(std::nullptr_t){}
+
+		explicit operator bool() const{
+			return state_ != nullptr;
+		}
+
+		// Requests that could have been hedged, second transfers started, second
+		// transfers that finished first, and hedges the budget did not allow
+		std::uint64_t Requests() const{
+			return state_->requests_;
+		}
+		std::uint64_t Hedged() const{
+			return state_->hedged_;
+		}
+		std::uint64_t Won() const{
+			return state_->won_;
+		}
+		std::uint64_t Denied() const{
+			return state_->denied_;
+		}
+	};
+
+	// Caps retries at a fraction of the requests that could have been retried,
+	// plus a reserve so that clients with little traffic can still retry.
+	// Copies share the budget and counts
+	class RetryBudget{
+		struct State{
+			double max_extra_;
+			std::uint64_t reserve_;
+			std::atomic<std::uint64_t> requests_;
+			std::atomic<std::uint64_t> retried_;
+			std::atomic<std::uint64_t> denied_;
+
+			State(double max_extra, std::uint64_t reserve)
+				:max_extra_{ max_extra }, reserve_{ reserve }, requests_{ 0 }, retried_{ 0 }, denied_{ 0 }{}
+		};
+		std::shared_ptr<State> state_;
+
+		void Track(){
+			++state_->requests_;
+		}
+
+		// Takes one retry out of the budget if there is room for it
+		bool TryRetry(){
+			auto retried = state_->retried_.load();
+			for (;;){
+				auto allowed = static_cast<double>(state_->reserve_) + state_->max_extra_ * static_cast<double>(state_->requests_.load());
+				if (static_cast<double>(retried + 1) > allowed){
+					++state_->denied_;
+					return false;
+				}
+				if (state_->retried_.compare_exchange_weak(retried, retried + 1)){
+					return true;
+				}
+			}
+		}
+
+		friend struct HttpClient;
+
+	public:
+		// max_extra is the most extra load retries may add, 0.1 allows one retry
+		// for every 10 requests on top of reserve
+		explicit RetryBudget(double max_extra, std::uint64_t reserve = 10) :state_{ std::make_shared<State>(max_extra, reserve) }{
+			if (!(max_extra >= 0)){
+				throw cppcomponents::error_invalid_arg();
+			}
+		}
+
+		// No limit besides Request::MaxRetries
+		RetryBudget(std::nullptr_t){}
+
+		explicit operator bool() const{
+			return state_ != nullptr;
+		}
+
+		// Requests that could have been retried, retries made, and retries the
+		// budget did not allow
+		std::uint64_t Requests() const{
+			return state_->requests_;
+		}
+		std::uint64_t Retried() const{
+			return state_->retried_;
+		}
+		std::uint64_t Denied() const{
+			return state_->denied_;
+		}
+	};
+
 	struct HttpClient{
 	private:
 
 		cppcomponents::use<IMulti> multi_;
-		Easy easy_;
+		cppcomponents::use<IMulti2> multi2_;
+		cppcomponents::use<IEasyPool> pool_;
+		cppcomponents::use<IEasy> easy_;
+
+		// A fresh response for every fetch, buffers handed out by BodyBuffers are never written again
+		cppcomponents::use<IResponse> response_;
+
+		// Set once easy_ has been handed to the multi, which gives pooled handles back on completion
+		bool submitted_ = false;
+
+		// Request::CompletionExecutor of the fetch being prepared
+		cppcomponents::use<cppcomponents::IExecutor> completion_executor_;
+
+		cppcomponents::use<IResponseCache> cache_;
+		SingleFlight single_flight_ = nullptr;
+		HedgeBudget hedge_budget_ = nullptr;
+		RetryBudget retry_budget_ = nullptr;
+
+		struct StreamingWriter :std::enable_shared_from_this<StreamingWriter>{
+			cppcomponents::Channel<cppcomponents::use<cppcomponents::IBuffer>> chan_;
+			cppcomponents::use<IMulti2> multi_;
+			cppcomponents::use<IEasy> easy_;
+			std::size_t chunk_size_;
+			std::size_t max_in_flight_;
+			std::atomic<std::size_t> in_flight_;
+			std::atomic<bool> paused_;
+			// The transfer that paused, a resume after it is over does nothing
+			std::atomic<std::uint64_t> transfer_;
+			cppcomponents::use<cppcomponents::IBuffer> pending_;
+
+			StreamingWriter(const Request& req, cppcomponents::use<IMulti2> multi, cppcomponents::use<IEasy> easy)
+				:chan_{ req.StreamingChannel }, multi_{ multi }, easy_{ easy }, chunk_size_{ req.StreamingChunkSize },
+				max_in_flight_{ req.MaxStreamingBuffersInFlight }, in_flight_{ 0 }, paused_{ false }, transfer_{ 0 }
+			{}
+
+			void Send(cppcomponents::use<cppcomponents::IBuffer> buffer){
+				++in_flight_;
+				auto self = shared_from_this();
+				chan_.Write(buffer).Then([self](cppcomponents::Future<void>){
+					self->Written();
+				});
+			}
 
-		Response response_;
+			// Runs on the reader's thread
+			void Written(){
+				--in_flight_;
+				if (paused_.exchange(false)){
+					multi_.PauseTransfer(easy_, transfer_, Constants::Pause::CURLPAUSE_CONT);
+				}
+			}
 
-		void HandleOptions(const Request& req){
-			easy_.SetPointerOption(Constants::Options::CURLOPT_URL, const_cast<char*>(req.Url.c_str()));
+			bool Full(){
+				if (!max_in_flight_ || in_flight_ < max_in_flight_){
+					return false;
+				}
+				transfer_ = easy_.QueryInterface<IEasy2>().GetTransfer();
+				paused_ = true;
+				// A read may have completed before paused_ was set. If Written already took
+				// paused_ the resume is queued on the loop and runs after we return
+				if (in_flight_ < max_in_flight_ && paused_.exchange(false)){
+					return false;
+				}
+				return true;
+			}
 
-			HandleMethod(req);
-			HandleWriteFunction(req);
-			HandleHeaderFunction(req);
-			HandleProgressFunction(req);
+			std::size_t Write(const char* p, std::size_t sz){
+				if (Full()){
+					// libcurl delivers the same data again once resumed
+					return Constants::CallbackReturn::CURL_WRITEFUNC_PAUSE;
+				}
+				if (!chunk_size_){
+					auto buffer = cppcomponents::Buffer::Create(sz);
+					buffer.SetSize(sz);
+					std::copy(p, p + sz, buffer.Begin());
+					Send(buffer);
+					return sz;
+				}
+				auto first = p;
+				auto last = p + sz;
+				while (first != last){
+					if (!pending_){
+						pending_ = cppcomponents::Buffer::Create(chunk_size_);
+						pending_.SetSize(0);
+					}
+					auto used = pending_.Size();
+					auto n = std::min<std::size_t>(last - first, chunk_size_ - used);
+					std::copy(first, first + n, pending_.Begin() + used);
+					pending_.SetSize(used + n);
+					first += n;
+					if (pending_.Size() == chunk_size_){
+						Send(pending_);
+						pending_ = nullptr;
+					}
+				}
+				return sz;
+			}
+
+			void Flush(){
+				if (pending_ && pending_.Size()){
+					Send(pending_);
+				}
+				pending_ = nullptr;
+			}
+		};
+
+		std::shared_ptr<StreamingWriter> streaming_;
+
+		// The request body as a list of ranges. The owners of the ranges are kept
+		// alive by the completion callback until the transfer is done
+		struct BodySource{
+			std::shared_ptr<std::string> str_;
+			std::vector<cppcomponents::use<cppcomponents::IBuffer>> buffers_;
+			std::vector<std::pair<const char*, std::size_t>> ranges_;
+			std::unique_ptr<std::ifstream> file_;
+			std::size_t index_;
+			std::size_t offset_;
+			std::uint64_t size_;
+
+			BodySource(const Request& req) :index_{ 0 }, offset_{ 0 }, size_{ 0 }{
+				if (!req.UploadFile.empty()){
+					file_.reset(new std::ifstream{ req.UploadFile, std::ios::binary });
+					if (!*file_ || !file_->seekg(0, std::ios::end)){
+						throw cppcomponents::error_fail();
+					}
+					size_ = static_cast<std::uint64_t>(file_->tellg());
+					file_->seekg(0, std::ios::beg);
+					return;
+				}
+				if (!req.BodyBuffers.empty()){
+					buffers_ = req.BodyBuffers;
+					for (auto& b : buffers_){
+						if (b.Size()){
+							ranges_.push_back(std::make_pair(static_cast<const char*>(b.Begin()), static_cast<std::size_t>(b.Size())));
+						}
+					}
+				}
+				else if (!req.Body.empty()){
+					// The only copy of a string body
+					str_ = std::make_shared<std::string>(req.Body);
+					ranges_.push_back(std::make_pair(str_->data(), str_->size()));
+				}
+				for (auto& r : ranges_){
+					size_ += r.second;
+				}
+			}
 
+			std::size_t Read(char* out, std::size_t count){
+				if (file_){
+					file_->read(out, count);
+					if (file_->bad()){
+						return Constants::CallbackReturn::CURL_READFUNC_ABORT;
+					}
+					return static_cast<std::size_t>(file_->gcount());
+				}
+				std::size_t n = 0;
+				while (n < count && index_ < ranges_.size()){
+					auto& r = ranges_[index_];
+					auto m = std::min(count - n, r.second - offset_);
+					std::copy(r.first + offset_, r.first + offset_ + m, out + n);
+					n += m;
+					offset_ += m;
+					if (offset_ == r.second){
+						++index_;
+						offset_ = 0;
+					}
+				}
+				return n;
+			}
+		};
+
+		std::shared_ptr<BodySource> body_;
+
+		struct ChannelUpload :std::enable_shared_from_this<ChannelUpload>{
+			cppcomponents::Channel<cppcomponents::use<cppcomponents::IBuffer>> chan_;
+			cppcomponents::use<IMulti2> multi_;
+			cppcomponents::use<IEasy> easy_;
+
+			std::mutex mut_;
+			cppcomponents::use<cppcomponents::IBuffer> current_;
+			std::size_t offset_;
+			bool reading_;
+			bool paused_;
+			// The transfer that paused, a resume after it is over does nothing
+			std::uint64_t transfer_;
+			bool done_;
+			bool failed_;
+
+			ChannelUpload(const Request& req, cppcomponents::use<IMulti2> multi, cppcomponents::use<IEasy> easy)
+				:chan_{ req.UploadChannel }, multi_{ multi }, easy_{ easy }, offset_{ 0 },
+				reading_{ false }, paused_{ false }, transfer_{ 0 }, done_{ false }, failed_{ false }
+			{}
+
+			// Runs on the loop thread
+			std::size_t Read(char* out, std::size_t count){
+				std::unique_lock<std::mutex> lock{ mut_ };
+				for (;;){
+					if (current_ && offset_ < current_.Size()){
+						auto n = std::min<std::size_t>(count, current_.Size() - offset_);
+						auto begin = current_.Begin() + offset_;
+						std::copy(begin, begin + n, out);
+						offset_ += n;
+						return n;
+					}
+					if (failed_){
+						return Constants::CallbackReturn::CURL_READFUNC_ABORT;
+					}
+					if (done_){
+						return 0;
+					}
+					if (reading_){
+						// Received resumes the transfer
+						paused_ = true;
+						transfer_ = easy_.QueryInterface<IEasy2>().GetTransfer();
+						return Constants::CallbackReturn::CURL_READFUNC_PAUSE;
+					}
+					reading_ = true;
+					current_ = nullptr;
+					offset_ = 0;
+					lock.unlock();
+					auto self = shared_from_this();
+					chan_.Read().Then([self](cppcomponents::Future<cppcomponents::use<cppcomponents::IBuffer>> f){
+						self->Received(f);
+					});
+					// If the read completed already, go round again and copy it
+					lock.lock();
+				}
+			}
 
-			// Handle headers
-			if (!req.Headers.empty()){
-				Slist sl;
-				for (auto& p : req.Headers){
-					sl.Append(p.first + ':' + p.second);
+			void Received(cppcomponents::Future<cppcomponents::use<cppcomponents::IBuffer>>& f){
+				bool resume = false;
+				std::uint64_t transfer = 0;
+				{
+					std::unique_lock<std::mutex> lock{ mut_ };
+					if (f.ErrorCode() < 0){
+						failed_ = true;
+					}
+					else{
+						auto buffer = f.Get();
+						if (!buffer || buffer.Size() == 0){
+							done_ = true;
+						}
+						else{
+							current_ = buffer;
+						}
+					}
+					reading_ = false;
+					resume = paused_;
+					paused_ = false;
+					transfer = transfer_;
+				}
+				if (resume){
+					multi_.PauseTransfer(easy_, transfer, Constants::Pause::CURLPAUSE_CONT);
 				}
-				easy_.SetPointerOption(Constants::Options::CURLOPT_HEADER, sl.get_portable_base());
 			}
+		};
+
+		std::shared_ptr<ChannelUpload> upload_;
+
+		void SetReadFromChannel(const Request& req){
+			upload_ = std::make_shared<ChannelUpload>(req, multi2_, easy_);
+			auto upload = upload_;
+			easy_.SetFunctionOption(Constants::Options::CURLOPT_READFUNCTION,
+				cppcomponents::make_delegate<Callbacks::ReadFunction>([upload](void* ptr, std::size_t size,
+				std::size_t nmemb)mutable -> std::size_t{
+				return upload->Read(static_cast<char*>(ptr), size*nmemb);
+			}));
+		}
+
+		void SetReadFromBody(){
+			auto body = body_;
+			easy_.SetFunctionOption(Constants::Options::CURLOPT_READFUNCTION,
+				cppcomponents::make_delegate<Callbacks::ReadFunction>([body](void* ptr, std::size_t size,
+				std::size_t nmemb)mutable -> std::size_t{
+				return body->Read(static_cast<char*>(ptr), size*nmemb);
+			}));
+		}
 
-			// Rest of options handled alphabetically
-			//#define CURL_IPRESOLVE_WHATEVER 0 default, resolves addresses to all IP
-			//			versions that your system allows 
-			//#define CURL_IPRESOLVE_V4       1 /* resolve to ipv4 addresses 
-			//#define CURL_IPRESOLVE_V6       2 /* resolve to ipv6 addresses 
-			if (req.AllowIPv6){
-				easy_.SetInt32Option(Constants::Options::CURLOPT_IPRESOLVE, 1);
+		void PrepareEasy(){
+			if (pool_){
+				// Pooled clients only hold a handle between preparing and submitting a fetch
+				if (!easy_ || submitted_){
+					easy_ = pool_.Acquire();
+					submitted_ = false;
+				}
 			}
 			else{
-				easy_.SetInt32Option(Constants::Options::CURLOPT_IPRESOLVE, 0);
-			}
-
-			easy_.SetInt32Option(Constants::Options::CURLOPT_HTTPAUTH, req.AuthMode);
-
-			if (req.CACerts.size()){
-				easy_.SetStringOption(Constants::Options::CURLOPT_CAINFO, req.CACerts);
-			}
-
-			if (req.ClientCert.size()){
-                easy_.SetStringOption(Constants::Options::CURLOPT_SSLCERT, req.ClientCert);
-			}
-            if (req.ClientKey.size()){
-                easy_.SetStringOption(Constants::Options::CURLOPT_KEYPASSWD, req.ClientKey);
-
-            }
-            if (req.ConnectTimeout != 0){
-                easy_.SetInt32Option(Constants::Options::CURLOPT_CONNECTTIMEOUT_MS, req.ConnectTimeout);
-            }
-            if (req.Cookie.size()){
-                easy_.SetStringOption(Constants::Options::CURLOPT_COOKIE, req.Cookie);
-            }
-            if (req.CookieFile.size()){
-                easy_.SetStringOption(Constants::Options::CURLOPT_COOKIEFILE, req.CookieFile);
-            }
-            
-            easy_.SetInt32Option(Constants::Options::CURLOPT_FOLLOWLOCATION, req.FollowRedirects ? 1 : 0);
-
-            if (req.MaxRedirects != 0){
-                easy_.SetInt32Option(Constants::Options::CURLOPT_MAXREDIRS, req.MaxRedirects);
-            }
-
-            if (req.NetworkInterface.size()){
-                easy_.SetStringOption(Constants::Options::CURLOPT_INTERFACE, req.NetworkInterface);
-            }
-
-            if (req.Password.size()){
-                easy_.SetStringOption(Constants::Options::CURLOPT_PASSWORD, req.Password);
-            }
-
-            if (req.ProxyHost.size()){
-                easy_.SetStringOption(Constants::Options::CURLOPT_PROXY, req.ProxyHost);
-            }
-
-            if (req.ProxyPort != 0){
-                easy_.SetInt32Option(Constants::Options::CURLOPT_PROXYPORT, req.ProxyPort);
-            }
-
-            if (req.ProxyPassword.size()){
-                easy_.SetStringOption(Constants::Options::CURLOPT_PROXYPASSWORD, req.ProxyPassword);
-            }
-            if (req.ProxyUsername.size()){
-                easy_.SetStringOption(Constants::Options::CURLOPT_PROXYUSERNAME, req.ProxyUsername);
-            }
-            if (req.Referer.size()){
-                easy_.SetStringOption(Constants::Options::CURLOPT_REFERER, req.Referer);
-            }
-
-            if (req.RequestTimeout != 0){
-                easy_.SetInt32Option(Constants::Options::CURLOPT_TIMEOUT_MS, req.RequestTimeout);
-            }
-
-            if (req.Url.size()){
-                easy_.SetStringOption(Constants::Options::CURLOPT_URL, req.Url);
-            }
-            if (req.UseGzip){
-                easy_.SetStringOption(Constants::Options::CURLOPT_ACCEPT_ENCODING, "");
-            }
-            if (req.UserAgent.size()){
-                easy_.SetStringOption(Constants::Options::CURLOPT_USERAGENT, req.UserAgent);
-            }
-            if (req.Username.size()){
-                easy_.SetStringOption(Constants::Options::CURLOPT_USERNAME, req.Username);
-            }
-            
-            easy_.SetInt32Option(Constants::Options::CURLOPT_SSL_VERIFYHOST, req.ValidateCert ? 2 : 0);
-
-            HandleMethod(req);
-            HandleWriteFunction(req);
-            HandleProgressFunction(req);
-            HandleHeaderFunction(req);
+				easy_.Reset();
+			}
+			response_ = Response{ easy_ };
+		}
 
+		// Gives a pooled handle that was never submitted back to the pool
+		void ReleaseEasy(){
+			if (pool_ && easy_ && !submitted_){
+				try{
+					pool_.Release(easy_);
+				}
+				catch (std::exception&){
+					// not from the pool, a template's handle
+				}
+			}
+			easy_ = nullptr;
+		}
+
+		void HandleOptions(const Request& req){
+			ApplyCommonOptions(easy_, req);
+			HandleRequestOptions(req);
+		}
+
+		// Options that change with every request
+		void HandleRequestOptions(const Request& req){
+			easy_.SetStringOption(Constants::Options::CURLOPT_URL, req.Url);
+			easy_.QueryInterface<IEasy2>().SetPriority(req.Priority);
+			completion_executor_ = req.CompletionExecutor;
+			HandleMethod(req);
+			HandleWriteFunction(req);
+			HandleHeaderFunction(req);
+			HandleProgressFunction(req);
 		}
 
 		void HandleMethod(const Request& req){
+			body_ = nullptr;
+			upload_ = nullptr;
 			// Default to GET
 			if (req.Method.size() == 0 || req.Method == "GET"){
 				easy_.SetInt32Option(Constants::Options::CURLOPT_HTTPGET, 1);
 
 			}
+			else if (req.Method == "PUT" && req.UploadChannel){
+				easy_.SetInt32Option(Constants::Options::CURLOPT_UPLOAD, 1);
+				if (req.UploadSize >= 0){
+					easy_.SetInt64Option(Constants::Options::CURLOPT_INFILESIZE_LARGE, req.UploadSize);
+				}
+				SetReadFromChannel(req);
+			}
+			else if (req.Method == "POST" && req.UploadChannel){
+				easy_.SetInt32Option(Constants::Options::CURLOPT_POST, 1);
+				// -1 makes libcurl use chunked encoding
+				easy_.SetInt64Option(Constants::Options::CURLOPT_POSTFIELDSIZE_LARGE, req.UploadSize);
+				SetReadFromChannel(req);
+			}
 			else if (req.Method == "PUT"){
-				auto body = req.Body;
+				body_ = std::make_shared<BodySource>(req);
 				easy_.SetInt32Option(Constants::Options::CURLOPT_UPLOAD, 1);
-				easy_.SetInt32Option(Constants::Options::CURLOPT_INFILESIZE, body.size());
-				std::size_t pos = 0;
-				easy_.SetFunctionOption(Constants::Options::CURLOPT_READFUNCTION,
-					cppcomponents::make_delegate<Callbacks::ReadFunction>([body, pos](void* ptr, std::size_t size,
-					std::size_t nmemb)mutable -> std::size_t{
-					if (pos >= body.size()){
-						return 0;
-					}
-					auto cptr = static_cast<char*>(ptr);
-					auto count = size*nmemb;
-					auto remaining = body.size() - pos;
-					auto begin = &body[0];
-					auto end = begin + body.size();;
-					if (remaining <= count){
-						std::copy(begin + pos, end, cptr);
-						pos = body.size();
-						return remaining;
-					}
-					else{
-						std::copy(begin + pos, begin + pos + count, cptr);
-						pos += count;
-						return count;
-					}
-
-				}));
+				easy_.SetInt64Option(Constants::Options::CURLOPT_INFILESIZE_LARGE, body_->size_);
+				SetReadFromBody();
 			}
 
 			else if (req.Method == "POST"){
-				auto body = req.Body;
+				body_ = std::make_shared<BodySource>(req);
 				easy_.SetInt32Option(Constants::Options::CURLOPT_POST, 1);
-				easy_.SetInt32Option(Constants::Options::CURLOPT_POSTFIELDSIZE, body.size());
-				char* begin = 0;
-				if (body.size()){
-					begin = const_cast<char*>(&body[0]);
+				easy_.SetInt64Option(Constants::Options::CURLOPT_POSTFIELDSIZE_LARGE, body_->size_);
+				if (body_->file_){
+					SetReadFromBody();
+				}
+				else if (body_->ranges_.size() == 1){
+					// libcurl sends straight from our memory
+					easy_.SetPointerOption(Constants::Options::CURLOPT_POSTFIELDS, const_cast<char*>(body_->ranges_.front().first));
+				}
+				else if (body_->ranges_.empty()){
+					easy_.SetPointerOption(Constants::Options::CURLOPT_POSTFIELDS, const_cast<char*>(""));
+				}
+				else{
+					// Without POSTFIELDS libcurl reads the body through the read callback
+					SetReadFromBody();
 				}
-				easy_.SetPointerOption(Constants::Options::CURLOPT_COPYPOSTFIELDS, begin);
 
 
 			}
@@ -251,18 +995,15 @@ namespace cppcomponents_libcurl_libuv{
 
 		void HandleWriteFunction(const Request& req){
 			cppcomponents::use<Callbacks::WriteFunction> writer_func;
+			streaming_ = nullptr;
 			if (req.StreamingChannel){
-				auto chan = req.StreamingChannel;
-				auto func = [chan](char* p, std::size_t n, std::size_t nmemb) mutable -> std::size_t{
-					auto sz = n*nmemb;
-					auto buffer = cppcomponents::Buffer::Create(sz);
-					buffer.SetSize(sz);
-					std::copy(p, p + sz, buffer.Begin());
-					chan.Write(buffer);
-					return sz;
+				auto writer = std::make_shared<StreamingWriter>(req, multi2_, easy_);
+				auto func = [writer](char* p, std::size_t n, std::size_t nmemb) mutable -> std::size_t{
+					return writer->Write(p, n*nmemb);
 				};
 
 				writer_func = cppcomponents::make_delegate<Callbacks::WriteFunction>(func);
+				streaming_ = writer;
 
 			}
 			else{
@@ -324,61 +1065,700 @@ namespace cppcomponents_libcurl_libuv{
 			}
 
 		}
-	public:
-		HttpClient(cppcomponents::use<IMulti> m) :multi_{ m }, easy_{}, response_{ easy_ }
-		{}
-		HttpClient() :HttpClient{ Curl::DefaultMulti() }
-		{}
+		typedef decltype(cppcomponents::make_promise<cppcomponents::use<IResponse>>()) ResponsePromise;
 
+		// The transfer set up in easy_, ready to be added to the multi
+		struct PreparedFetch{
+			cppcomponents::use<IEasy> easy;
+			cppcomponents::use<Callbacks::CompletedFunction> completed;
+			ResponsePromise promise;
+			cppcomponents::use<IEasyPool> pool;
 
-		cppcomponents::use<IEasy> GetEasy(){
-			return easy_;
-		}
+			cppcomponents::Future<cppcomponents::use<IResponse>> GetFuture(){
+				return promise.QueryInterface < cppcomponents::IFuture<cppcomponents::use<IResponse>> >();
+			}
 
-		cppcomponents::Future<cppcomponents::use<IResponse>> Fetch(){
-			auto promise = cppcomponents::make_promise<cppcomponents::use<IResponse>>();
+			// The multi did not take the handle
+			void AddFailed(cppcomponents::error_code ec){
+				CleanupCallbacks(easy);
+				if (pool){
+					pool.Release(easy);
+				}
+				promise.SetError(ec);
+			}
+		};
+
+		// The completion callback of the transfer set up in easy_. Calls
+		// done(response, ec) on the completion executor, ec < 0 if the response
+		// could not be completed. The response is always completed on the loop
+		// thread, before a pooled handle goes back to the pool
+		template<class F>
+		cppcomponents::use<Callbacks::CompletedFunction> MakeCompleted(F done){
 			auto easy = easy_;
 			cppcomponents::use<IResponse> response = response_;
-			auto completed = [easy, promise, response](cppcomponents::use<IEasy>, std::int32_t ec)mutable{
+			auto streaming = streaming_;
+			auto body = body_;
+			auto upload = upload_;
+			auto executor = completion_executor_;
+			auto completed = [easy, response, streaming, body, upload, executor, done](cppcomponents::use<IEasy>, std::int32_t ec)mutable{
+				cppcomponents::error_code err = 0;
 				try{
 					CleanupCallbacks(easy);
-					if (ec != Constants::Errors::CURLE_OK){
-						auto rw = response.QueryInterface<IResponseWriter>();
-						rw.SetError(ec);
-
+					if (streaming){
+						streaming->Flush();
 					}
-					promise.Set(response);
+					// libcurl no longer reads from the request body
+					body = nullptr;
+					upload = nullptr;
+					auto rw = response.QueryInterface<IResponseWriter2>();
+					rw.Complete(ec);
 				}
 				catch (std::exception& e)
 				{
-					//try{
-					promise.SetError(cppcomponents::error_mapper::error_code_from_exception(e));
-					//}
-					//catch (...){}
+					err = cppcomponents::error_mapper::error_code_from_exception(e);
+				}
+				if (executor){
+					try{
+						executor.Add([response, err, done]()mutable{
+							done(response, err);
+						});
+						return;
+					}
+					catch (std::exception&){
+						// run it here rather than lose the completion
+					}
 				}
+				done(response, err);
 			};
-			multi_.Add(easy_, cppcomponents::make_delegate<Callbacks::CompletedFunction>(completed))
-				.Then([promise, easy](cppcomponents::Future<void> f)mutable{
+			submitted_ = true;
+			return cppcomponents::make_delegate<Callbacks::CompletedFunction>(completed);
+		}
+
+		PreparedFetch Prepare(){
+			auto promise = cppcomponents::make_promise<cppcomponents::use<IResponse>>();
+			auto done = [promise](cppcomponents::use<IResponse> response, cppcomponents::error_code ec)mutable{
+				if (ec < 0){
+					promise.SetError(ec);
+				}
+				else{
+					promise.Set(response);
+				}
+			};
+
+			PreparedFetch p;
+			p.easy = easy_;
+			p.completed = MakeCompleted(done);
+			p.promise = promise;
+			p.pool = pool_;
+			return p;
+		}
+
+		// GETs with nothing to deliver through channels
+		static bool IsPlainGet(const Request& req){
+			return (req.Method.empty() || req.Method == "GET") && req.Body.empty() && req.BodyBuffers.empty()
+				&& req.UploadFile.empty() && !req.UploadChannel && !req.StreamingChannel && !req.HeaderChannel;
+		}
+
+		static std::string Lower(std::string s){
+			std::transform(s.begin(), s.end(), s.begin(), [](char c){
+				return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+			});
+			return s;
+		}
+
+		// Plain GETs without credentials, cookies or a client certificate. Their
+		// responses are for that user only, so they are not cached
+		static bool IsCacheable(const Request& req){
+			if (!IsPlainGet(req) || !req.Username.empty() || !req.Password.empty() || !req.Cookie.empty()
+				|| !req.CookieFile.empty() || !req.ClientCert.empty()){
+				return false;
+			}
+			for (auto& h : req.Headers){
+				auto name = Lower(h.first);
+				if (name == "authorization" || name == "cookie"){
+					return false;
+				}
+			}
+			return true;
+		}
+
+		// The same key as a single flight that compares all headers, so a
+		// response is only served to requests with the same options, such as
+		// certificate validation and proxy
+		static std::string CacheKey(const Request& req){
+			return SingleFlight::Key(req, std::vector<std::string>{});
+		}
+
+		cppcomponents::Future<cppcomponents::use<IResponse>> FetchCached(const Request& req){
+			auto cache = cache_;
+			auto key = CacheKey(req);
+			auto promise = cppcomponents::make_promise<cppcomponents::use<IResponse>>();
+			auto future = promise.QueryInterface<cppcomponents::IFuture<cppcomponents::use<IResponse>>>();
+			auto fresh = cache.GetFresh(key);
+			if (fresh){
+				promise.Set(fresh);
+				return CompleteOn(req.CompletionExecutor, future);
+			}
+			auto stale = cache.GetStale(key);
+			cppcomponents::Future<cppcomponents::use<IResponse>> f;
+			if (stale){
+				Request conditional = req;
+				auto stale2 = stale.QueryInterface<IResponse2>();
+				auto etag = stale2.Header("ETag");
+				if (etag.size()){
+					conditional.Headers.push_back(std::make_pair(std::string{ "If-None-Match" }, etag.to_string()));
+				}
+				auto modified = stale2.Header("Last-Modified");
+				if (modified.size()){
+					conditional.Headers.push_back(std::make_pair(std::string{ "If-Modified-Since" }, modified.to_string()));
+				}
+				f = FetchNetwork(conditional);
+			}
+			else{
+				f = FetchNetwork(req);
+			}
+			f.Then([cache, key, stale, promise](cppcomponents::Future<cppcomponents::use<IResponse>> f)mutable{
+				if (f.ErrorCode() < 0){
+					promise.SetError(f.ErrorCode());
+					return;
+				}
+				try{
+					promise.Set(cache.Update(key, f.Get(), stale));
+				}
+				catch (std::exception& e){
+					promise.SetError(cppcomponents::error_mapper::error_code_from_exception(e));
+				}
+			});
+			return future;
+		}
+
+		cppcomponents::Future<cppcomponents::use<IResponse>> FetchCoalesced(const Request& req){
+			auto key = single_flight_.KeyOf(req);
+			auto joined = single_flight_.Join(key);
+			if (joined){
+				// Set on the thread the first request completes on
+				return CompleteOn(req.CompletionExecutor, joined);
+			}
+			auto single_flight = single_flight_;
+			auto promise = cppcomponents::make_promise<cppcomponents::use<IResponse>>();
+			auto future = promise.QueryInterface<cppcomponents::IFuture<cppcomponents::use<IResponse>>>();
+			cppcomponents::Future<cppcomponents::use<IResponse>> f;
+			try{
+				if (cache_ && IsCacheable(req)){
+					f = FetchCached(req);
+				}
+				else{
+					f = FetchNetwork(req);
+				}
+			}
+			catch (std::exception& e){
+				single_flight.Fail(key, cppcomponents::error_mapper::error_code_from_exception(e));
+				throw;
+			}
+			f.Then([single_flight, key, promise](cppcomponents::Future<cppcomponents::use<IResponse>> f)mutable{
+				single_flight.Finish(key, f, promise);
+			});
+			return future;
+		}
+
+		// Transfers req, hedging it if it asks for that. Only here does a pooled
+		// client take a handle, cache hits and coalesced requests need none
+		cppcomponents::Future<cppcomponents::use<IResponse>> FetchNetwork(const Request& req){
+			PrepareEasy();
+			if (hedge_budget_ && (req.HedgeDelay || req.HedgeAtHostP95) && IsPlainGet(req)){
+				return FetchHedged(req);
+			}
+			if (IsRetryable(req)){
+				return FetchRetried(req);
+			}
+			HandleOptions(req);
+			return Fetch();
+		}
+
+		// Sets promise from f on executor, or right here if there is none
+		static void CompleteOn(cppcomponents::use<cppcomponents::IExecutor> executor, ResponsePromise promise,
+			cppcomponents::Future<cppcomponents::use<IResponse>> f){
+			auto set = [promise, f]()mutable{
 				if (f.ErrorCode() < 0){
-					CleanupCallbacks(easy);
 					promise.SetError(f.ErrorCode());
 				}
+				else{
+					promise.Set(f.Get());
+				}
+			};
+			if (executor){
+				try{
+					executor.Add(set);
+					return;
+				}
+				catch (std::exception&){
+					// run it here rather than lose the completion
+				}
+			}
+			set();
+		}
+
+		// f, completed on executor if there is one
+		static cppcomponents::Future<cppcomponents::use<IResponse>> CompleteOn(cppcomponents::use<cppcomponents::IExecutor> executor,
+			cppcomponents::Future<cppcomponents::use<IResponse>> f){
+			if (!executor){
+				return f;
+			}
+			auto promise = cppcomponents::make_promise<cppcomponents::use<IResponse>>();
+			f.Then([executor, promise](cppcomponents::Future<cppcomponents::use<IResponse>> f){
+				CompleteOn(executor, promise, f);
+			});
+			return promise.QueryInterface<cppcomponents::IFuture<cppcomponents::use<IResponse>>>();
+		}
+
+		// The first of two transfers of the same request to finish
+		struct HedgeState :std::enable_shared_from_this<HedgeState>{
+			cppcomponents::use<IMulti> multi_;
+			cppcomponents::use<IEasyPool> pool_;
+			HedgeBudget budget_;
+			cppcomponents::use<cppcomponents::IExecutor> executor_;
+			ResponsePromise promise_;
+
+			std::mutex mut_;
+			bool done_;
+			// Transfers started and not yet finished
+			int running_;
+			cppcomponents::use<IEasy> primary_;
+			cppcomponents::use<IEasy> hedge_;
+			std::shared_ptr<HttpClient> client_;
+
+			HedgeState(cppcomponents::use<IMulti> multi, cppcomponents::use<IEasyPool> pool, HedgeBudget budget,
+				cppcomponents::use<cppcomponents::IExecutor> executor)
+				:multi_{ multi }, pool_{ pool }, budget_{ budget }, executor_{ executor },
+				promise_{ cppcomponents::make_promise<cppcomponents::use<IResponse>>() }, done_{ false }, running_{ 1 }
+			{}
+
+			// Runs on the loop thread once the delay has passed
+			void Start(const Request& req){
+				{
+					std::unique_lock<std::mutex> lock{ mut_ };
+					if (done_){
+						return;
+					}
+				}
+				if (!budget_.TryHedge()){
+					return;
+				}
+				auto client = pool_ ? std::make_shared<HttpClient>(multi_, pool_) : std::make_shared<HttpClient>(multi_);
+				cppcomponents::Future<cppcomponents::use<IResponse>> f;
+				try{
+					f = client->Fetch(req);
+				}
+				catch (std::exception&){
+					// The first transfer is still running
+					return;
+				}
+				bool cancel = false;
+				{
+					std::unique_lock<std::mutex> lock{ mut_ };
+					client_ = client;
+					hedge_ = client->GetEasy();
+					++running_;
+					cancel = done_;
+				}
+				if (cancel){
+					Cancel(hedge_);
+				}
+				auto self = this->shared_from_this();
+				f.Then([self](cppcomponents::Future<cppcomponents::use<IResponse>> f){
+					self->Finish(f, true);
+				});
+			}
+
+			void Finish(cppcomponents::Future<cppcomponents::use<IResponse>>& f, bool hedge){
+				bool failed = f.ErrorCode() < 0 || f.Get().ErrorCode() < 0;
+				cppcomponents::use<IEasy> loser;
+				{
+					std::unique_lock<std::mutex> lock{ mut_ };
+					--running_;
+					// A failure only wins if the other transfer cannot do better
+					if (done_ || (failed && running_ > 0)){
+						return;
+					}
+					done_ = true;
+					if (running_ > 0){
+						loser = hedge ? primary_ : hedge_;
+					}
+				}
+				if (hedge){
+					budget_.RecordWin();
+				}
+				if (loser && hedge){
+					// The client reuses its handle once the future completes, so
+					// wait until it is out of the multi
+					auto self = this->shared_from_this();
+					try{
+						multi_.Remove(loser).Then([self, f](cppcomponents::Future<void>)mutable{
+							self->Complete(f);
+						});
+						return;
+					}
+					catch (std::exception&){
+						// complete anyway
+					}
+				}
+				else if (loser){
+					Cancel(loser);
+				}
+				Complete(f);
+			}
+
+			void Cancel(cppcomponents::use<IEasy> easy){
+				try{
+					multi_.Remove(easy);
+				}
+				catch (std::exception&){
+					// it completes by itself
+				}
+			}
+
+			void Complete(cppcomponents::Future<cppcomponents::use<IResponse>>& f){
+				CompleteOn(executor_, promise_, f);
+			}
+		};
+
+		cppcomponents::Future<cppcomponents::use<IResponse>> FetchHedged(const Request& req){
+			std::uint32_t delay = req.HedgeDelay;
+			if (req.HedgeAtHostP95){
+				try{
+					auto p95 = multi_.QueryInterface<IMultiStats>().HostPercentile(req.Url, 0.95);
+					if (p95){
+						delay = static_cast<std::uint32_t>(p95 / 1000);
+						if (!delay){
+							delay = 1;
+						}
+					}
+				}
+				catch (std::exception&){
+					// This multi keeps no stats, use HedgeDelay
+				}
+			}
+			if (!delay){
+				HandleOptions(req);
+				return Fetch();
+			}
+			hedge_budget_.Track();
+
+			// Both transfers run on one multi and complete on its loop thread, so
+			// the loser is removed before the multi can give its handle back to the
+			// pool. A MultiGroup would spread them over its loops, so they are
+			// pinned to the member with the fewest transfers in progress
+			auto multi = multi_;
+			auto group = multi_.QueryInterfaceNoThrow<IMultiGroup>();
+			if (group){
+				std::uint32_t best = 0;
+				for (std::uint32_t i = 1; i < group.Size(); ++i){
+					if (group.Outstanding(i) < group.Outstanding(best)){
+						best = i;
+					}
+				}
+				multi = group.GetMulti(best);
+			}
+
+			// The hedge is the retry, neither transfer retries by itself
+			Request leg = req;
+			leg.CompletionExecutor = nullptr;
+			leg.MaxRetries = 0;
+			auto state = std::make_shared<HedgeState>(multi, pool_, hedge_budget_, req.CompletionExecutor);
+			auto future = state->promise_.QueryInterface<cppcomponents::IFuture<cppcomponents::use<IResponse>>>();
+			std::shared_ptr<HttpClient> primary{ new HttpClient{ multi, pool_, easy_ } };
+			primary->HandleOptions(leg);
+			state->primary_ = easy_;
+			// The multi takes the handle from here on, a pooled one is given back
+			submitted_ = true;
+			primary->Fetch().Then([state, primary](cppcomponents::Future<cppcomponents::use<IResponse>> f){
+				state->Finish(f, false);
+			});
+
+			leg.ProgressChannel = decltype(leg.ProgressChannel){};
+			multi.QueryInterface<IMulti2>().After(delay).Then([state, leg](cppcomponents::Future<void> f){
+				if (f.ErrorCode() < 0){
+					return;
+				}
+				state->Start(leg);
 			});
+			return future;
+		}
+
+		static bool IsRetryable(const Request& req){
+			return req.MaxRetries && req.Method != "POST" && !req.UploadChannel && !req.StreamingChannel && !req.HeaderChannel;
+		}
+
+		// The attempts of one request. Each retry runs on the handle of the attempt
+		// before it with only the options of HandleRequestOptions set again, unless
+		// the handles come from a pool
+		struct RetryState :std::enable_shared_from_this<RetryState>{
+			std::shared_ptr<HttpClient> client_;
+			Request req_;
+			RetryBudget budget_;
+			cppcomponents::use<cppcomponents::IExecutor> executor_;
+			ResponsePromise promise_;
+			std::uint32_t retries_;
+			std::minstd_rand rng_;
+
+			RetryState(std::shared_ptr<HttpClient> client, const Request& req, RetryBudget budget,
+				cppcomponents::use<cppcomponents::IExecutor> executor)
+				:client_{ client }, req_(req), budget_{ budget }, executor_{ executor },
+				promise_{ cppcomponents::make_promise<cppcomponents::use<IResponse>>() }, retries_{ 0 },
+				rng_{ static_cast<std::minstd_rand::result_type>(std::chrono::steady_clock::now().time_since_epoch().count()
+				^ reinterpret_cast<std::uintptr_t>(this)) }
+			{}
+
+			// The options of the attempt are set in client_
+			void Start(){
+				auto self = this->shared_from_this();
+				client_->Fetch().Then([self](cppcomponents::Future<cppcomponents::use<IResponse>> f){
+					self->Completed(f);
+				});
+			}
 
-			return promise.QueryInterface < cppcomponents::IFuture<cppcomponents::use<IResponse>> >();
+			bool ShouldRetry(cppcomponents::Future<cppcomponents::use<IResponse>>& f){
+				if (retries_ >= req_.MaxRetries || f.ErrorCode() < 0){
+					return false;
+				}
+				auto response = f.Get();
+				auto ec = response.ErrorCode();
+				bool retry = false;
+				if (ec < 0){
+					retry = std::find(req_.RetryErrors.begin(), req_.RetryErrors.end(), ec) != req_.RetryErrors.end();
+				}
+				else{
+					auto code = response.ResponseCode();
+					retry = std::find(req_.RetryStatuses.begin(), req_.RetryStatuses.end(), code) != req_.RetryStatuses.end();
+				}
+				if (!retry){
+					return false;
+				}
+				return !budget_ || budget_.TryRetry();
+			}
+
+			std::uint32_t Delay(){
+				return RetryDelay(req_, retries_, rng_);
+			}
+
+			// Runs on the loop thread
+			void Completed(cppcomponents::Future<cppcomponents::use<IResponse>>& f){
+				if (!ShouldRetry(f)){
+					CompleteOn(executor_, promise_, f);
+					return;
+				}
+				++retries_;
+				auto self = this->shared_from_this();
+				try{
+					client_->multi2_.After(Delay()).Then([self, f](cppcomponents::Future<void> timer)mutable{
+						if (timer.ErrorCode() < 0){
+							CompleteOn(self->executor_, self->promise_, f);
+							return;
+						}
+						self->Retry(f);
+					});
+				}
+				catch (std::exception&){
+					CompleteOn(executor_, promise_, f);
+				}
+			}
+
+			// Runs on the loop thread, last is the response given if the retry
+			// cannot be started
+			void Retry(cppcomponents::Future<cppcomponents::use<IResponse>>& last){
+				auto& client = *client_;
+				try{
+					if (client.pool_){
+						// The multi gave the handle back to the pool
+						client.PrepareEasy();
+						client.HandleOptions(req_);
+					}
+					else{
+						// The rest of the options are still set on the handle. The
+						// response of the last attempt may still be read
+						client.response_ = Response{ client.easy_ };
+						client.HandleRequestOptions(req_);
+					}
+					Start();
+				}
+				catch (std::exception&){
+					CompleteOn(executor_, promise_, last);
+				}
+			}
+		};
+
+		cppcomponents::Future<cppcomponents::use<IResponse>> FetchRetried(const Request& req){
+			if (retry_budget_){
+				retry_budget_.Track();
+			}
+			// Attempts complete on the loop thread, where their retries are started
+			Request attempt = req;
+			attempt.CompletionExecutor = nullptr;
+			std::shared_ptr<HttpClient> client{ new HttpClient{ multi_, pool_, easy_ } };
+			auto state = std::make_shared<RetryState>(client, attempt, retry_budget_, req.CompletionExecutor);
+			auto future = state->promise_.QueryInterface<cppcomponents::IFuture<cppcomponents::use<IResponse>>>();
+			client->HandleOptions(attempt);
+			// The multi takes the handle from here on, a pooled one is given back
+			submitted_ = true;
+			state->Start();
+			return future;
+		}
+
+		// Shares easy with another client, which gives it back to the pool if it
+		// is never submitted
+		HttpClient(cppcomponents::use<IMulti> m, cppcomponents::use<IEasyPool> pool, cppcomponents::use<IEasy> easy)
+			:multi_{ m }, multi2_{ m.QueryInterface<IMulti2>() }, pool_{ pool }, easy_{ easy }, response_{ Response{ easy_ } },
+			submitted_{ true }
+		{}
+
+		friend class Batch;
+
+	public:
+		HttpClient(cppcomponents::use<IMulti> m) :multi_{ m }, multi2_{ m.QueryInterface<IMulti2>() }, easy_{ Easy{} },
+			response_{ Response{ easy_ } }
+		{}
+		HttpClient() :HttpClient{ Curl::DefaultMulti() }
+		{}
+
+		// Each Fetch acquires a handle from pool, the multi returns it on completion
+		HttpClient(cppcomponents::use<IMulti> m, cppcomponents::use<IEasyPool> pool)
+			:multi_{ m }, multi2_{ m.QueryInterface<IMulti2>() }, pool_{ pool }
+		{}
+
+		// A pooled handle taken for a fetch that was never submitted goes back
+		~HttpClient(){
+			ReleaseEasy();
+		}
+		HttpClient(const HttpClient&) = delete;
+		HttpClient& operator=(const HttpClient&) = delete;
+
+
+		// A pooled client acquires its handle here if it has none yet
+		cppcomponents::use<IEasy> GetEasy(){
+			if (!easy_){
+				PrepareEasy();
+			}
+			return easy_;
+		}
+
+		// Milliseconds to wait before retrying req when it has been retried retry
+		// times already. Exponential backoff with the wait picked from the upper
+		// half, so that requests that failed together do not retry together
+		static std::uint32_t RetryDelay(const Request& req, std::uint32_t retry, std::minstd_rand& rng){
+			std::uint64_t cap = req.RetryBaseDelay;
+			for (std::uint32_t i = 0; i < retry && cap < req.RetryMaxDelay; ++i){
+				cap *= 2;
+			}
+			if (cap > req.RetryMaxDelay){
+				cap = req.RetryMaxDelay;
+			}
+			auto half = cap / 2;
+			std::uniform_int_distribution<std::uint64_t> dist{ 0, cap - half };
+			return static_cast<std::uint32_t>(half + dist(rng));
+		}
+
+		cppcomponents::Future<cppcomponents::use<IResponse>> Fetch(){
+			auto p = Prepare();
+			multi_.Add(p.easy, p.completed)
+				.Then([p](cppcomponents::Future<void> f)mutable{
+				if (f.ErrorCode() < 0){
+					p.AddFailed(f.ErrorCode());
+				}
+			});
+
+			return p.GetFuture();
 
 		}
 
 		cppcomponents::Future<cppcomponents::use<IResponse>> Fetch(const Request& req){
-			easy_.Reset();
 			if (!req.Url.size()){ throw cppcomponents::error_invalid_arg(); }
-            HandleOptions(req);
+			if (single_flight_ && IsPlainGet(req)){
+				return FetchCoalesced(req);
+			}
+			if (cache_ && IsCacheable(req)){
+				return FetchCached(req);
+			}
+			return FetchNetwork(req);
+		}
+
+		// Fetch(const Request&) of a plain GET waits for an identical one already
+		// in flight through any client sharing single_flight, instead of starting
+		// its own transfer. Its future completes on its own CompletionExecutor if
+		// it has one. nullptr stops coalescing
+		void SetSingleFlight(SingleFlight single_flight){
+			single_flight_ = single_flight;
+		}
+
+		// Fetch(const Request&) answers plain GETs from cache while they are fresh,
+		// and revalidates stale ones with If-None-Match or If-Modified-Since. The
+		// key is the url with the request headers and options, and requests with
+		// credentials or cookies are not cached. A hit completes the future right
+		// away, on req.CompletionExecutor if there is one and otherwise on this
+		// thread. nullptr stops caching
+		void SetCache(cppcomponents::use<IResponseCache> cache){
+			cache_ = cache;
+		}
+
+		// Lets Fetch(const Request&) hedge plain GETs that set HedgeDelay or
+		// HedgeAtHostP95, as far as budget allows. The loser is cancelled with
+		// IMulti::Remove. Cache misses and coalesced requests are hedged as one
+		// request. nullptr stops hedging
+		void SetHedgeBudget(HedgeBudget budget){
+			hedge_budget_ = budget;
+		}
+
+		// Retries made by Fetch(const Request&) for requests with MaxRetries come
+		// out of budget. nullptr only limits them by MaxRetries
+		void SetRetryBudget(RetryBudget budget){
+			retry_budget_ = budget;
+		}
+
+		// Uses the options of the template, and only Url, Method, Body, the
+		// channels and the completion executor of req
+		cppcomponents::Future<cppcomponents::use<IResponse>> Fetch(const RequestTemplate& t, const Request& req){
+			if (!req.Url.size()){ throw cppcomponents::error_invalid_arg(); }
+			ReleaseEasy();
+			easy_ = t.Create();
+			response_ = Response{ easy_ };
+			submitted_ = false;
+			HandleRequestOptions(req);
 			return Fetch();
 		}
 
+		cppcomponents::Future<cppcomponents::use<IResponse>> Fetch(const RequestTemplate& t, const std::string& url){
+			Request req{ url };
+			req.Method = t.GetRequest().Method;
+			req.CompletionExecutor = t.GetRequest().CompletionExecutor;
+			return Fetch(t, req);
+		}
+
+		// Fetches without a promise, future or continuation. on_complete(response)
+		// runs straight from the multi's completion, on req.CompletionExecutor if
+		// set and otherwise on the loop thread, where it must not block. Exceptions
+		// it throws are dropped. Transfer errors, including a handle the multi
+		// could not add, are reported by response.ErrorCode()
+		template<class F>
+		void Start(const Request& req, F on_complete){
+			if (!req.Url.size()){ throw cppcomponents::error_invalid_arg(); }
+			PrepareEasy();
+			HandleOptions(req);
+			auto done = [on_complete](cppcomponents::use<IResponse> response, cppcomponents::error_code ec)mutable{
+				try{
+					if (ec < 0){
+						response.QueryInterface<IResponseWriter>().SetError(ec);
+					}
+					on_complete(response);
+				}
+				catch (...){
+					// swallow exceptions
+				}
+			};
+			multi2_.Start(easy_, MakeCompleted(done));
+		}
+
 		cppcomponents::Future<cppcomponents::use<IResponse>> Fetch(const Request& req, cppcomponents::use<IForm> form){
-			easy_.Reset();
 			if (!req.Url.size()){ throw cppcomponents::error_invalid_arg(); }
+			PrepareEasy();
 			if ((!req.Method.empty()) || (req.Method != "POST")){
 				throw cppcomponents::error_invalid_arg();
 			}
@@ -390,6 +1770,161 @@ namespace cppcomponents_libcurl_libuv{
 
 	};
 
+	// Fetches many requests keeping at most max_in_flight transfers running. The
+	// first transfers are handed to the multi with a single AddMany call and each
+	// completion starts the next request from the loop thread
+	class Batch{
+		typedef decltype(cppcomponents::make_promise<std::vector<cppcomponents::use<IResponse>>>()) ResultPromise;
+
+		struct State :std::enable_shared_from_this<State>{
+			cppcomponents::use<IMulti2> multi_;
+			std::vector<Request> requests_;
+			std::vector<cppcomponents::use<IResponse>> responses_;
+			// One client per transfer in flight
+			std::vector<std::unique_ptr<HttpClient>> slots_;
+			cppcomponents::Channel<cppcomponents::use<IResponse>> completed_;
+			ResultPromise promise_;
+
+			std::mutex mut_;
+			std::size_t next_;
+			std::size_t done_;
+			cppcomponents::error_code error_;
+
+			State() :next_{ 0 }, done_{ 0 }, error_{ 0 }{}
+
+			// Sets up the next request on slot, false once there are none left
+			bool PrepareNext(std::size_t slot, HttpClient::PreparedFetch& out){
+				for (;;){
+					std::size_t index;
+					{
+						std::unique_lock<std::mutex> lock{ mut_ };
+						if (next_ == requests_.size()){
+							return false;
+						}
+						index = next_++;
+					}
+					auto& client = *slots_[slot];
+					try{
+						auto& req = requests_[index];
+						if (!req.Url.size()){ throw cppcomponents::error_invalid_arg(); }
+						client.PrepareEasy();
+						client.HandleOptions(req);
+						out = client.Prepare();
+					}
+					catch (std::exception& e){
+						Finished(index, nullptr, cppcomponents::error_mapper::error_code_from_exception(e));
+						continue;
+					}
+					auto self = this->shared_from_this();
+					out.GetFuture().Then([self, slot, index](cppcomponents::Future<cppcomponents::use<IResponse>> f){
+						self->Completed(slot, index, f);
+					});
+					return true;
+				}
+			}
+
+			// Runs on the loop thread
+			void Completed(std::size_t slot, std::size_t index, cppcomponents::Future<cppcomponents::use<IResponse>>& f){
+				if (f.ErrorCode() < 0){
+					Finished(index, nullptr, f.ErrorCode());
+				}
+				else{
+					Finished(index, f.Get(), 0);
+				}
+				// A failed add completes through p.completed, so no future is needed
+				HttpClient::PreparedFetch p;
+				if (PrepareNext(slot, p)){
+					multi_.Start(p.easy, p.completed);
+				}
+			}
+
+			void Finished(std::size_t index, cppcomponents::use<IResponse> response, cppcomponents::error_code ec){
+				bool all = false;
+				{
+					std::unique_lock<std::mutex> lock{ mut_ };
+					responses_[index] = response;
+					if (ec < 0 && error_ == 0){
+						error_ = ec;
+					}
+					all = ++done_ == requests_.size();
+				}
+				if (response && completed_){
+					completed_.Write(response);
+				}
+				if (all){
+					if (error_ < 0){
+						promise_.SetError(error_);
+					}
+					else{
+						promise_.Set(responses_);
+					}
+				}
+			}
+		};
+
+		cppcomponents::use<IMulti> multi_;
+		cppcomponents::use<IEasyPool> pool_;
+
+	public:
+		Batch(cppcomponents::use<IMulti> m) :multi_{ m }{}
+		Batch() :Batch{ Curl::DefaultMulti() }{}
+		Batch(cppcomponents::use<IMulti> m, cppcomponents::use<IEasyPool> pool) :multi_{ m }, pool_{ pool }{}
+
+		// The responses are in the order of requests. Transfer errors are reported
+		// by IResponse::ErrorCode, the future only fails if a request could not be
+		// started. max_in_flight == 0 starts all requests at once
+		cppcomponents::Future<std::vector<cppcomponents::use<IResponse>>> Fetch(std::vector<Request> requests, std::size_t max_in_flight){
+			return Fetch(std::move(requests), max_in_flight, cppcomponents::Channel<cppcomponents::use<IResponse>>{});
+		}
+
+		// Also writes each response to completed as it finishes
+		cppcomponents::Future<std::vector<cppcomponents::use<IResponse>>> Fetch(std::vector<Request> requests, std::size_t max_in_flight,
+			cppcomponents::Channel<cppcomponents::use<IResponse>> completed){
+			auto state = std::make_shared<State>();
+			state->multi_ = multi_.QueryInterface<IMulti2>();
+			state->requests_ = std::move(requests);
+			state->responses_.resize(state->requests_.size());
+			state->completed_ = completed;
+			state->promise_ = cppcomponents::make_promise<std::vector<cppcomponents::use<IResponse>>>();
+			auto future = state->promise_.QueryInterface<cppcomponents::IFuture<std::vector<cppcomponents::use<IResponse>>>>();
+
+			if (state->requests_.empty()){
+				state->promise_.Set(state->responses_);
+				return future;
+			}
+			auto slots = state->requests_.size();
+			if (max_in_flight != 0 && max_in_flight < slots){
+				slots = max_in_flight;
+			}
+			for (std::size_t i = 0; i < slots; ++i){
+				state->slots_.emplace_back(pool_ ? new HttpClient{ multi_, pool_ } : new HttpClient{ multi_ });
+			}
+
+			std::vector<HttpClient::PreparedFetch> prepared;
+			std::vector<cppcomponents::use<IEasy>> easies;
+			std::vector<cppcomponents::use<Callbacks::CompletedFunction>> funcs;
+			for (std::size_t slot = 0; slot < slots; ++slot){
+				HttpClient::PreparedFetch p;
+				if (!state->PrepareNext(slot, p)){
+					break;
+				}
+				easies.push_back(p.easy);
+				funcs.push_back(p.completed);
+				prepared.push_back(p);
+			}
+			if (!easies.empty()){
+				state->multi_.AddMany(easies, funcs).Then([prepared](cppcomponents::Future<void> f)mutable{
+					if (f.ErrorCode() < 0){
+						for (auto& p : prepared){
+							p.AddFailed(f.ErrorCode());
+						}
+					}
+				});
+			}
+			return future;
+		}
+	};
+
 }
 
 
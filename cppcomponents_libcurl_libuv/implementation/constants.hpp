@@ -867,6 +867,9 @@ namespace cppcomponents_libcurl_libuv{
 				* prototype defines. (Deprecates CURLOPT_PROGRESSFUNCTION) */
 				CPPCOMPONENTS_LIBCURL_LIBUV_CINIT(XFERINFOFUNCTION, FUNCTIONPOINT, 219),
 
+				/* Wait for pipelining/multiplexing, requires libcurl 7.43.0 or later */
+				CPPCOMPONENTS_LIBCURL_LIBUV_CINIT(PIPEWAIT, LONG, 237),
+
 				CURLOPT_LASTENTRY /* the last unused */
 			};
 		}
@@ -929,6 +932,77 @@ namespace cppcomponents_libcurl_libuv{
 			} ;
 
 		}
+		namespace Pause{
+			enum{
+				CURLPAUSE_RECV = (1 << 0),
+				CURLPAUSE_RECV_CONT = 0,
+				CURLPAUSE_SEND = (1 << 2),
+				CURLPAUSE_SEND_CONT = 0,
+				CURLPAUSE_ALL = (CURLPAUSE_RECV | CURLPAUSE_SEND),
+				CURLPAUSE_CONT = (CURLPAUSE_RECV_CONT | CURLPAUSE_SEND_CONT)
+			};
+		}
+
+		// Special return values for the write and read callbacks
+		namespace CallbackReturn{
+			enum{
+				CURL_WRITEFUNC_PAUSE = 0x10000001,
+				CURL_READFUNC_ABORT = 0x10000000,
+				CURL_READFUNC_PAUSE = 0x10000001
+			};
+		}
+
+		// Values for CURLOPT_HTTP_VERSION
+		namespace HttpVersion{
+			enum{
+				CURL_HTTP_VERSION_NONE = 0,
+				CURL_HTTP_VERSION_1_0 = 1,
+				CURL_HTTP_VERSION_1_1 = 2,
+				/* requires libcurl 7.33.0 or later */
+				CURL_HTTP_VERSION_2_0 = 3,
+				/* HTTP/2 for https only, requires libcurl 7.47.0 or later */
+				CURL_HTTP_VERSION_2TLS = 4,
+				/* HTTP/2 without upgrade, requires libcurl 7.49.0 or later */
+				CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE = 5
+			};
+		}
+
+		// Options for curl_multi_setopt that take a long, the callback options
+		// are used by Multi itself
+		namespace MultiOptions{
+			enum{
+				CURLMOPT_PIPELINING = 3,
+				CURLMOPT_MAXCONNECTS = 6,
+				/* requires libcurl 7.30.0 or later */
+				CURLMOPT_MAX_HOST_CONNECTIONS = 7,
+				CURLMOPT_MAX_PIPELINE_LENGTH = 8,
+				CURLMOPT_MAX_TOTAL_CONNECTIONS = 13
+			};
+		}
+
+		// Values for CURLMOPT_PIPELINING
+		namespace Pipelining{
+			enum{
+				CURLPIPE_NOTHING = 0,
+				CURLPIPE_HTTP1 = 1,
+				/* requires libcurl 7.43.0 or later */
+				CURLPIPE_MULTIPLEX = 2
+			};
+		}
+
+		// Data that can be shared between handles with curl_share_setopt
+		namespace Share{
+			enum{
+				CURL_LOCK_DATA_NONE = 0,
+				CURL_LOCK_DATA_SHARE = 1,
+				CURL_LOCK_DATA_COOKIE = 2,
+				CURL_LOCK_DATA_DNS = 3,
+				CURL_LOCK_DATA_SSL_SESSION = 4,
+				/* requires libcurl 7.57.0 or later */
+				CURL_LOCK_DATA_CONNECT = 5,
+				CURL_LOCK_DATA_LAST
+			};
+		}
 		/*
 		* Bitmasks for CURLOPT_HTTPAUTH and CURLOPT_PROXYAUTH options:
 		*
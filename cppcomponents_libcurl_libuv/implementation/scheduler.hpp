@@ -0,0 +1,187 @@
+#pragma once
+#ifndef INCLUDE_GUARD_CPPCOMPONENTS_LIBCURL_LIBUV_IMPLEMENTATION_SCHEDULER_HPP_
+#define INCLUDE_GUARD_CPPCOMPONENTS_LIBCURL_LIBUV_IMPLEMENTATION_SCHEDULER_HPP_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace cppcomponents_libcurl_libuv{
+	namespace detail{
+
+		// Queues transfers in front of the multi. Each host has a queue per
+		// priority class, 0 the highest, and each class a ring of the hosts
+		// with waiting transfers so hosts take turns. Not thread safe, the multi
+		// only uses it on the loop thread
+		template<class T, std::size_t Classes>
+		class transfer_scheduler{
+			struct host_state{
+				std::int32_t active;
+				std::array<std::deque<T>, Classes> waiting;
+				std::array<bool, Classes> in_ring;
+				host_state() :active{ 0 }{
+					in_ring.fill(false);
+				}
+			};
+			typedef std::unordered_map<std::string, host_state> host_table;
+
+			host_table hosts_;
+			std::array<std::deque<std::string>, Classes> rings_;
+			std::int32_t max_active_;
+			std::int32_t max_active_per_host_;
+			std::int32_t active_;
+			std::size_t waiting_;
+
+			bool has_room(const host_state& h) const{
+				return max_active_per_host_ == 0 || h.active < max_active_per_host_;
+			}
+
+			void erase_if_idle(typename host_table::iterator iter){
+				if (iter == hosts_.end()){
+					return;
+				}
+				auto& h = iter->second;
+				if (h.active){
+					return;
+				}
+				for (std::size_t p = 0; p < Classes; ++p){
+					if (!h.waiting[p].empty() || h.in_ring[p]){
+						return;
+					}
+				}
+				hosts_.erase(iter);
+			}
+
+		public:
+			transfer_scheduler() :max_active_{ 0 }, max_active_per_host_{ 0 }, active_{ 0 }, waiting_{ 0 }{}
+
+			// 0 is no limit
+			void set_max_active(std::int32_t n){
+				max_active_ = n;
+			}
+			void set_max_active_per_host(std::int32_t n){
+				max_active_per_host_ = n;
+			}
+
+			std::int32_t active() const{
+				return active_;
+			}
+			std::size_t waiting() const{
+				return waiting_;
+			}
+
+			bool has_room() const{
+				return max_active_ == 0 || active_ < max_active_;
+			}
+
+			// True if a new transfer to host can skip the queues
+			bool can_start(const std::string& host) const{
+				if (waiting_ != 0 || !has_room()){
+					return false;
+				}
+				auto iter = hosts_.find(host);
+				return iter == hosts_.end() || has_room(iter->second);
+			}
+
+			void push(const std::string& host, std::size_t priority, T item){
+				auto& h = hosts_[host];
+				h.waiting[priority].push_back(std::move(item));
+				++waiting_;
+				if (!h.in_ring[priority]){
+					h.in_ring[priority] = true;
+					rings_[priority].push_back(host);
+				}
+			}
+
+			// Takes the next transfer that may start, the higher classes first and
+			// hosts in turn within a class. The caller reports it with started
+			// once it is running, or with release if it could not be started
+			bool next(T& item, std::string& host){
+				if (waiting_ == 0 || !has_room()){
+					return false;
+				}
+				for (std::size_t p = 0; p < Classes; ++p){
+					auto& ring = rings_[p];
+					for (auto n = ring.size(); n > 0; --n){
+						auto name = std::move(ring.front());
+						ring.pop_front();
+						auto iter = hosts_.find(name);
+						if (iter == hosts_.end()){
+							continue;
+						}
+						auto& h = iter->second;
+						if (h.waiting[p].empty()){
+							// Its transfers were removed while waiting
+							h.in_ring[p] = false;
+							erase_if_idle(iter);
+							continue;
+						}
+						if (!has_room(h)){
+							ring.push_back(std::move(name));
+							continue;
+						}
+						item = std::move(h.waiting[p].front());
+						h.waiting[p].pop_front();
+						--waiting_;
+						if (h.waiting[p].empty()){
+							h.in_ring[p] = false;
+						}
+						else{
+							ring.push_back(name);
+						}
+						host = std::move(name);
+						return true;
+					}
+				}
+				return false;
+			}
+
+			void started(const std::string& host){
+				++active_;
+				++hosts_[host].active;
+			}
+
+			void finished(const std::string& host){
+				--active_;
+				auto iter = hosts_.find(host);
+				if (iter != hosts_.end()){
+					--iter->second.active;
+					erase_if_idle(iter);
+				}
+			}
+
+			// Forgets host if it has nothing running or waiting
+			void release(const std::string& host){
+				erase_if_idle(hosts_.find(host));
+			}
+
+			// Takes the first waiting transfer to host that matches out of its queue
+			template<class Pred>
+			bool remove(const std::string& host, Pred pred, T& item){
+				auto iter = hosts_.find(host);
+				if (iter == hosts_.end()){
+					return false;
+				}
+				for (auto& queue : iter->second.waiting){
+					for (auto w = queue.begin(); w != queue.end(); ++w){
+						if (pred(*w)){
+							item = std::move(*w);
+							queue.erase(w);
+							--waiting_;
+							erase_if_idle(iter);
+							return true;
+						}
+					}
+				}
+				return false;
+			}
+		};
+
+	}
+}
+
+#endif
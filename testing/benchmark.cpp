@@ -0,0 +1,394 @@
+// Benchmarks HttpClient against an in-process HTTP/1.1 server on 127.0.0.1, so
+// the numbers measure this library and libcurl rather than the network.
+//
+// benchmark [max requests per scenario]
+//
+// For each body size, concurrency and buffered or streaming mode it prints
+// requests/sec, p50/p99 latency from IMultiStats, operator new calls of the
+// program and the library dll and CPU time per request. The server uses the libuv 1.x API directly and needs
+// libuv linked in.
+
+#ifdef _WIN32
+#define NOMINMAX
+#endif
+#include <uv.h>
+
+#include <cppcomponents_libcurl_libuv/http_client.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace cppcomponents_libcurl_libuv;
+
+// Allocation counting. On Windows this only sees the executable's, the dll
+// counts its own and Curl::Allocations() adds them
+namespace{
+	std::atomic<std::uint64_t> allocations{ 0 };
+}
+
+void* operator new(std::size_t n){
+	++allocations;
+	if (auto p = std::malloc(n ? n : 1)){
+		return p;
+	}
+	throw std::bad_alloc();
+}
+void operator delete(void* p) throw(){
+	std::free(p);
+}
+
+namespace{
+
+	double process_cpu_seconds(){
+#ifdef _WIN32
+		FILETIME create, exit, kernel, user;
+		if (!GetProcessTimes(GetCurrentProcess(), &create, &exit, &kernel, &user)){
+			return 0;
+		}
+		auto ticks = [](const FILETIME& ft){
+			return (static_cast<std::uint64_t>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+		};
+		return (ticks(kernel) + ticks(user)) / 1e7;
+#else
+		rusage ru;
+		getrusage(RUSAGE_SELF, &ru);
+		return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+#endif
+	}
+
+	// Blocks until f is ready
+	template<class T>
+	T wait(cppcomponents::Future<T> f){
+		auto p = std::make_shared<std::promise<T>>();
+		auto result = p->get_future();
+		f.Then([p](cppcomponents::Future<T> f){
+			if (f.ErrorCode() < 0){
+				p->set_exception(std::make_exception_ptr(std::runtime_error{ "future failed" }));
+			}
+			else{
+				p->set_value(f.Get());
+			}
+		});
+		return result.get();
+	}
+
+	// Answers GET /bytes/N with N bytes, keeping connections alive. Request
+	// bodies are read and dropped
+	class LoopbackServer{
+		static const std::size_t block_size = 1 << 20;
+
+		struct connection{
+			uv_tcp_t tcp;
+			std::string in;
+			char buffer[64 * 1024];
+		};
+
+		struct write_request{
+			uv_write_t req;
+			std::string head;
+			std::vector<uv_buf_t> bufs;
+		};
+
+		uv_loop_t loop_;
+		uv_tcp_t listener_;
+		uv_async_t stop_;
+		std::thread thread_;
+		int port_;
+
+		static const std::vector<char>& block(){
+			static std::vector<char> b(block_size, 'x');
+			return b;
+		}
+
+		static void on_close(uv_handle_t* handle){
+			delete static_cast<connection*>(handle->data);
+		}
+
+		static void on_alloc(uv_handle_t* handle, std::size_t, uv_buf_t* buf){
+			auto conn = static_cast<connection*>(handle->data);
+			*buf = uv_buf_init(conn->buffer, sizeof(conn->buffer));
+		}
+
+		static void on_write(uv_write_t* req, int){
+			delete reinterpret_cast<write_request*>(req);
+		}
+
+		static void respond(connection* conn, std::uint64_t size){
+			auto w = new write_request;
+			w->head = "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: "
+				+ std::to_string(size) + "\r\n\r\n";
+			w->bufs.push_back(uv_buf_init(&w->head[0], static_cast<unsigned int>(w->head.size())));
+			auto data = const_cast<char*>(block().data());
+			for (auto left = size; left > 0;){
+				auto n = left < block_size ? left : block_size;
+				w->bufs.push_back(uv_buf_init(data, static_cast<unsigned int>(n)));
+				left -= n;
+			}
+			uv_write(&w->req, reinterpret_cast<uv_stream_t*>(&conn->tcp), w->bufs.data(),
+				static_cast<unsigned int>(w->bufs.size()), on_write);
+		}
+
+		// Answers every complete request in conn->in
+		static void process(connection* conn){
+			for (;;){
+				auto end = conn->in.find("\r\n\r\n");
+				if (end == std::string::npos){
+					return;
+				}
+				auto head = conn->in.substr(0, end);
+				std::uint64_t body = 0;
+				auto cl = head.find("Content-Length:");
+				if (cl != std::string::npos){
+					body = std::strtoull(head.c_str() + cl + 15, nullptr, 10);
+				}
+				if (conn->in.size() < end + 4 + body){
+					return;
+				}
+				std::uint64_t size = 0;
+				auto path = head.find("/bytes/");
+				if (path != std::string::npos){
+					size = std::strtoull(head.c_str() + path + 7, nullptr, 10);
+				}
+				conn->in.erase(0, static_cast<std::size_t>(end + 4 + body));
+				respond(conn, size);
+			}
+		}
+
+		static void on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf){
+			auto conn = static_cast<connection*>(stream->data);
+			if (nread < 0){
+				uv_close(reinterpret_cast<uv_handle_t*>(stream), on_close);
+				return;
+			}
+			conn->in.append(buf->base, static_cast<std::size_t>(nread));
+			process(conn);
+		}
+
+		static void on_connection(uv_stream_t* server, int status){
+			if (status < 0){
+				return;
+			}
+			auto conn = new connection;
+			uv_tcp_init(server->loop, &conn->tcp);
+			conn->tcp.data = conn;
+			if (uv_accept(server, reinterpret_cast<uv_stream_t*>(&conn->tcp)) != 0){
+				uv_close(reinterpret_cast<uv_handle_t*>(&conn->tcp), on_close);
+				return;
+			}
+			uv_tcp_nodelay(&conn->tcp, 1);
+			uv_read_start(reinterpret_cast<uv_stream_t*>(&conn->tcp), on_alloc, on_read);
+		}
+
+		static void on_stop(uv_async_t* async){
+			uv_walk(async->loop, [](uv_handle_t* handle, void*){
+				if (!uv_is_closing(handle)){
+					uv_close(handle, on_close);
+				}
+			}, nullptr);
+		}
+
+	public:
+		LoopbackServer() :port_{ 0 }{
+			std::promise<int> ready;
+			auto port = ready.get_future();
+			thread_ = std::thread{ [this, &ready](){
+				uv_loop_init(&loop_);
+				uv_tcp_init(&loop_, &listener_);
+				listener_.data = nullptr;
+				uv_async_init(&loop_, &stop_, on_stop);
+				stop_.data = nullptr;
+
+				sockaddr_in addr;
+				uv_ip4_addr("127.0.0.1", 0, &addr);
+				uv_tcp_bind(&listener_, reinterpret_cast<const sockaddr*>(&addr), 0);
+				if (uv_listen(reinterpret_cast<uv_stream_t*>(&listener_), 128, on_connection) != 0){
+					ready.set_value(0);
+					return;
+				}
+				sockaddr_in bound;
+				int len = sizeof(bound);
+				uv_tcp_getsockname(&listener_, reinterpret_cast<sockaddr*>(&bound), &len);
+				ready.set_value(ntohs(bound.sin_port));
+
+				uv_run(&loop_, UV_RUN_DEFAULT);
+				uv_loop_close(&loop_);
+			} };
+			port_ = port.get();
+			if (!port_){
+				thread_.join();
+				throw std::runtime_error{ "could not listen on 127.0.0.1" };
+			}
+		}
+
+		~LoopbackServer(){
+			uv_async_send(&stop_);
+			thread_.join();
+		}
+
+		int Port() const{
+			return port_;
+		}
+	};
+
+	struct Scenario{
+		std::uint64_t body_size;
+		std::size_t concurrency;
+		bool streaming;
+		std::size_t requests;
+	};
+
+	// Counts the bytes of a StreamingChannel until the whole body has arrived
+	struct StreamReader :std::enable_shared_from_this<StreamReader>{
+		cppcomponents::Channel<cppcomponents::use<cppcomponents::IBuffer>> chan;
+		std::uint64_t expected;
+		std::uint64_t received;
+		std::promise<void> done;
+
+		StreamReader(cppcomponents::Channel<cppcomponents::use<cppcomponents::IBuffer>> c, std::uint64_t n)
+			:chan{ c }, expected{ n }, received{ 0 }{}
+
+		void Start(){
+			if (expected == 0){
+				done.set_value();
+				return;
+			}
+			Next();
+		}
+
+		void Next(){
+			auto self = shared_from_this();
+			chan.Read().Then([self](cppcomponents::Future<cppcomponents::use<cppcomponents::IBuffer>> f){
+				if (f.ErrorCode() < 0){
+					self->done.set_value();
+					return;
+				}
+				self->received += f.Get().Size();
+				if (self->received >= self->expected){
+					self->done.set_value();
+				}
+				else{
+					self->Next();
+				}
+			});
+		}
+	};
+
+	std::string format_size(std::uint64_t n){
+		if (n >= (1 << 20)){
+			return std::to_string(n >> 20) + " MB";
+		}
+		if (n >= 1024){
+			return std::to_string(n >> 10) + " KB";
+		}
+		return std::to_string(n) + " B";
+	}
+
+	void run(cppcomponents::use<IMulti> multi, cppcomponents::use<IEasyPool> pool, int port, const Scenario& s){
+		auto stats = multi.QueryInterface<IMultiStats>();
+
+		std::vector<Request> requests;
+		std::vector<std::shared_ptr<StreamReader>> readers;
+		auto url = "http://127.0.0.1:" + std::to_string(port) + "/bytes/" + std::to_string(s.body_size);
+		for (std::size_t i = 0; i < s.requests; ++i){
+			Request req{ url };
+			req.UseGzip = false;
+			if (s.streaming){
+				req.StreamingChannel = cppcomponents::make_channel<cppcomponents::use<cppcomponents::IBuffer>>();
+				req.StreamingChunkSize = 64 * 1024;
+				req.MaxStreamingBuffersInFlight = 16;
+				readers.push_back(std::make_shared<StreamReader>(req.StreamingChannel, s.body_size));
+			}
+			requests.push_back(req);
+		}
+
+		stats.Reset();
+		auto allocations_before = allocations.load() + Curl::Allocations();
+		auto cpu_before = process_cpu_seconds();
+		auto start = std::chrono::steady_clock::now();
+
+		for (auto& r : readers){
+			r->Start();
+		}
+		Batch batch{ multi, pool };
+		auto responses = wait(batch.Fetch(std::move(requests), s.concurrency));
+		std::size_t errors = 0;
+		for (std::size_t i = 0; i < responses.size(); ++i){
+			auto& r = responses[i];
+			if (r.ErrorCode() < 0 || r.ResponseCode() != 200){
+				++errors;
+				continue;
+			}
+			if (s.streaming){
+				readers[i]->done.get_future().wait();
+			}
+			else if (r.QueryInterface<IResponse2>().BodySize() != s.body_size){
+				++errors;
+			}
+		}
+
+		auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		auto cpu = process_cpu_seconds() - cpu_before;
+		auto allocated = allocations.load() + Curl::Allocations() - allocations_before;
+
+		auto latency = stats.LatencyHistogram(2);
+		auto counters = stats.Counters();
+		auto n = static_cast<double>(s.requests);
+		std::printf("%8s %5u %-9s %7u %10.0f %9.3f %9.3f %9.1f %9.1f %7.2f %6u\n",
+			format_size(s.body_size).c_str(), static_cast<unsigned>(s.concurrency), s.streaming ? "streaming" : "buffered",
+			static_cast<unsigned>(s.requests), n / seconds,
+			Histogram::Percentile(latency, 0.5) / 1e3, Histogram::Percentile(latency, 0.99) / 1e3,
+			allocated / n, cpu / n * 1e6, counters[MultiCounter::SocketActions] / n, static_cast<unsigned>(errors));
+	}
+
+}
+
+int main(int argc, char** argv){
+	std::size_t max_requests = 2000;
+	if (argc > 1){
+		max_requests = std::strtoul(argv[1], nullptr, 10);
+	}
+
+	LoopbackServer server;
+	auto multi = Curl::DefaultMulti();
+	EasyPool pool{ 256 };
+
+	const std::uint64_t sizes[] = { 0, 1024, 64 * 1024, 1 << 20, 100 << 20 };
+	const std::size_t concurrency[] = { 1, 16, 64 };
+
+	std::printf("%8s %5s %-9s %7s %10s %9s %9s %9s %9s %7s %6s\n",
+		"body", "conc", "mode", "reqs", "req/s", "p50 ms", "p99 ms", "new/req", "cpu us", "act/req", "errors");
+	for (auto size : sizes){
+		// Move about the same number of bytes in each scenario
+		std::uint64_t budget = 256ull << 20;
+		std::size_t requests = size ? static_cast<std::size_t>(budget / size) : max_requests;
+		if (requests > max_requests){
+			requests = max_requests;
+		}
+		if (requests < 4){
+			requests = 4;
+		}
+		for (auto c : concurrency){
+			for (int streaming = 0; streaming < 2; ++streaming){
+				Scenario s = { size, c, streaming != 0, requests };
+				run(multi, pool, server.Port(), s);
+			}
+		}
+	}
+	return 0;
+}
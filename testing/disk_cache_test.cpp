@@ -0,0 +1,159 @@
+#include "unit_tests.hpp"
+#include <cppcomponents_libcurl_libuv/cppcomponents_libcurl_libuv.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+#include <assert.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace cppcomponents_libcurl_libuv;
+
+namespace{
+	const std::uint64_t max_bytes = 64 * 1024 * 1024;
+
+	std::string make_directory(){
+		auto base = std::getenv("TEMP");
+		std::string dir = base ? base : "/tmp";
+		dir += "/cppcomponents_libcurl_libuv_disk_cache_test_"
+			+ std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+#ifdef _WIN32
+		auto res = _mkdir(dir.c_str());
+#else
+		auto res = mkdir(dir.c_str(), 0700);
+#endif
+		assert(res == 0);
+		(void)res;
+		return dir;
+	}
+
+	std::string segment_path(const std::string& dir, std::uint32_t id){
+		char name[32];
+		std::sprintf(name, "/segment-%08x.dat", id);
+		return dir + name;
+	}
+
+	bool exists(const std::string& path){
+		auto f = std::fopen(path.c_str(), "rb");
+		if (!f){
+			return false;
+		}
+		std::fclose(f);
+		return true;
+	}
+
+	void remove_directory(const std::string& dir){
+		for (std::uint32_t id = 0; id < 64; ++id){
+			std::remove(segment_path(dir, id).c_str());
+		}
+		std::remove((dir + "/index.dat").c_str());
+		std::remove((dir + "/index.dat.tmp").c_str());
+#ifdef _WIN32
+		_rmdir(dir.c_str());
+#else
+		rmdir(dir.c_str());
+#endif
+	}
+
+	cppcomponents::use<IResponse> response(const std::string& body){
+		std::vector<std::pair<std::string, std::string>> headers;
+		headers.push_back(std::make_pair(std::string{ "HTTP/1.1 200 OK" }, std::string{}));
+		headers.push_back(std::make_pair(std::string{ "Cache-Control" }, std::string{ "max-age=3600" }));
+		auto b = cppcomponents::Buffer::Create(body.size());
+		std::memcpy(b.Begin(), body.data(), body.size());
+		b.SetSize(body.size());
+		std::vector<cppcomponents::use<cppcomponents::IBuffer>> buffers;
+		buffers.push_back(b);
+		Response r{ cppcomponents::use<IEasy>{} };
+		r.QueryInterface<IResponseWriter2>().CompleteFrom(200, headers, buffers);
+		return r.QueryInterface<IResponse>();
+	}
+
+	std::string fresh_body(DiskResponseCache& cache, const char* key){
+		auto r = cache.GetFresh(key);
+		return r ? r.Body().to_string() : std::string{ "<none>" };
+	}
+}
+
+// Records are written by the cache's own thread, which finishes before the
+// cache is destroyed, so each check is made on a cache opened afterwards
+void test_disk_cache(){
+	auto dir = make_directory();
+	{
+		DiskResponseCache cache{ dir, max_bytes };
+		cache.Update("a", response("hello"), nullptr);
+		cache.Update("b", response("removed"), nullptr);
+		cache.Update("c", response("first"), nullptr);
+		cache.Update("c", response("second"), nullptr);
+		cache.Remove("b");
+	}
+	{
+		// Reopened from the index
+		DiskResponseCache cache{ dir, max_bytes };
+		assert(fresh_body(cache, "a") == "hello");
+		assert(!cache.GetStale("b"));
+		assert(fresh_body(cache, "c") == "second");
+		assert(cache.Counters()[CacheCounter::Entries] == 2);
+		// Hits read the body in place, so two of them share it
+		auto first = cache.GetFresh("a");
+		auto second = cache.GetFresh("a");
+		assert(first.Body().begin() == second.Body().begin());
+	}
+	{
+		// A record cut short at the end of the last segment, as a crash in the
+		// middle of a write leaves it
+		std::uint32_t last = 0;
+		while (exists(segment_path(dir, last + 1))){
+			++last;
+		}
+		assert(exists(segment_path(dir, last)));
+		auto f = std::fopen(segment_path(dir, last).c_str(), "ab");
+		assert(f);
+		std::uint32_t magic = 0x31524344;
+		std::fwrite(&magic, sizeof(magic), 1, f);
+		std::string garbage(60, '\xff');
+		std::fwrite(garbage.data(), 1, garbage.size(), f);
+		std::fclose(f);
+	}
+	{
+		// The whole records before it are still there, and new ones go after it
+		DiskResponseCache cache{ dir, max_bytes };
+		assert(fresh_body(cache, "a") == "hello");
+		assert(fresh_body(cache, "c") == "second");
+		cache.Update("d", response("after"), nullptr);
+	}
+	{
+		DiskResponseCache cache{ dir, max_bytes };
+		assert(fresh_body(cache, "a") == "hello");
+		assert(fresh_body(cache, "d") == "after");
+	}
+	{
+		// Without the index every segment is scanned
+		std::remove((dir + "/index.dat").c_str());
+		DiskResponseCache cache{ dir, max_bytes };
+		assert(fresh_body(cache, "a") == "hello");
+		assert(!cache.GetStale("b"));
+		assert(fresh_body(cache, "c") == "second");
+		assert(fresh_body(cache, "d") == "after");
+		cache.Clear();
+		assert(!cache.GetStale("a"));
+	}
+	{
+		DiskResponseCache cache{ dir, max_bytes };
+		assert(!cache.GetStale("a"));
+		assert(!cache.GetStale("d"));
+		assert(cache.Counters()[CacheCounter::Entries] == 0);
+	}
+	remove_directory(dir);
+}
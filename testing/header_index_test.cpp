@@ -0,0 +1,76 @@
+#include "unit_tests.hpp"
+#include <cppcomponents_libcurl_libuv/cppcomponents_libcurl_libuv.hpp>
+
+#include <string>
+#include <assert.h>
+
+using namespace cppcomponents_libcurl_libuv;
+
+namespace{
+	void add_header(cppcomponents::use<IResponseWriter> writer, const std::string& line){
+		auto crlf = line + "\r\n";
+		writer.AddToHeader(crlf.data(), crlf.data() + crlf.size());
+	}
+
+	cppcomponents::use<IResponse2> response_with(const char* const* lines, std::size_t n){
+		Response r{ cppcomponents::use<IEasy>{} };
+		auto writer = r.QueryInterface<IResponseWriter>();
+		for (std::size_t i = 0; i < n; ++i){
+			add_header(writer, lines[i]);
+		}
+		// The blank line ending the headers is not kept
+		add_header(writer, "");
+		return r.QueryInterface<IResponse2>();
+	}
+}
+
+void test_header_index(){
+	{
+		const char* lines[] = {
+			"HTTP/1.1 200 OK",
+			"Content-Type: text/plain",
+			"ETag:   \"abc\"  ",
+			"X-Empty:",
+		};
+		auto r = response_with(lines, 4);
+		assert(r.HeaderCount() == 4);
+		assert(r.HeaderName(1).to_string() == "Content-Type");
+		// Index access gives the raw value, Header trims it
+		assert(r.HeaderValue(2).to_string() == "   \"abc\"  ");
+		assert(r.Header("ETag").to_string() == "\"abc\"");
+		// Names are case-insensitive
+		assert(r.Header("content-type").to_string() == "text/plain");
+		assert(r.Header("CONTENT-TYPE").to_string() == "text/plain");
+		assert(r.Header("X-Empty").size() == 0);
+		assert(r.Header("Missing").size() == 0);
+	}
+	{
+		// After a redirect the later header, of the final response, wins
+		const char* lines[] = {
+			"HTTP/1.1 301 Moved Permanently",
+			"Location: /next",
+			"Cache-Control: max-age=31536000",
+			"HTTP/1.1 200 OK",
+			"Cache-Control: no-cache",
+		};
+		auto r = response_with(lines, 5);
+		assert(r.HeaderCount() == 5);
+		assert(r.Header("Cache-Control").to_string() == "no-cache");
+		assert(r.Header("Location").to_string() == "/next");
+	}
+	{
+		// Enough headers to grow the table well past its first size
+		std::string names[64];
+		const char* lines[64];
+		for (int i = 0; i < 64; ++i){
+			names[i] = "X-Header-" + std::to_string(i) + ": " + std::to_string(i * 7);
+			lines[i] = names[i].c_str();
+		}
+		auto r = response_with(lines, 64);
+		for (int i = 0; i < 64; ++i){
+			auto name = "x-header-" + std::to_string(i);
+			assert(r.Header(name).to_string() == std::to_string(i * 7));
+		}
+		assert(r.Header("x-header-64").size() == 0);
+	}
+}
@@ -0,0 +1,119 @@
+#include "unit_tests.hpp"
+#include <cppcomponents_libcurl_libuv/cppcomponents_libcurl_libuv.hpp>
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <assert.h>
+
+using namespace cppcomponents_libcurl_libuv;
+
+namespace{
+	void check_bucket(std::uint64_t micros){
+		auto index = Histogram::BucketIndex(micros);
+		assert(index < Histogram::Buckets);
+		auto lower = Histogram::BucketLowerBound(index);
+		assert(lower <= micros);
+		if (index + 1 < Histogram::Buckets){
+			assert(micros < Histogram::BucketLowerBound(index + 1));
+		}
+		if (micros < Histogram::SubBuckets){
+			assert(lower == micros);
+		}
+		else if (index + 1 < Histogram::Buckets){
+			// Within 25% of the value
+			assert((micros - lower) * 4 < lower);
+		}
+	}
+
+	std::vector<std::uint64_t> empty_histogram(){
+		return std::vector<std::uint64_t>(Histogram::Buckets);
+	}
+}
+
+void test_histogram(){
+	{
+		// Small values get a bucket each
+		for (std::uint64_t v = 0; v < 8; ++v){
+			assert(Histogram::BucketIndex(v) == v);
+			assert(Histogram::BucketLowerBound(static_cast<std::uint32_t>(v)) == v);
+		}
+		// Then each power of two is split in SubBuckets
+		assert(Histogram::BucketIndex(8) == 8);
+		assert(Histogram::BucketIndex(9) == 8);
+		assert(Histogram::BucketIndex(10) == 9);
+		assert(Histogram::BucketIndex(15) == 11);
+		assert(Histogram::BucketIndex(16) == 12);
+	}
+	{
+		// Bounds hold at and around every power of two
+		for (std::uint32_t e = 0; e < 40; ++e){
+			auto p = static_cast<std::uint64_t>(1) << e;
+			check_bucket(p - 1);
+			check_bucket(p);
+			check_bucket(p + 1);
+			check_bucket(p + p / 2);
+		}
+		for (std::uint64_t v = 0; v < 100000; v += 7){
+			check_bucket(v);
+		}
+		// Every bucket's lower bound maps back to it
+		for (std::uint32_t i = 0; i < Histogram::Buckets; ++i){
+			assert(Histogram::BucketIndex(Histogram::BucketLowerBound(i)) == i);
+		}
+	}
+	{
+		// Values past the range go in the last bucket
+		auto last = static_cast<std::uint32_t>(Histogram::Buckets - 1);
+		assert(Histogram::BucketIndex(Histogram::BucketLowerBound(last) * 4) == last);
+		assert(Histogram::BucketIndex(std::numeric_limits<std::uint64_t>::max()) == last);
+	}
+	{
+		auto h = empty_histogram();
+		assert(Histogram::Total(h) == 0);
+		assert(Histogram::Percentile(h, 0.5) == 0);
+		assert(Histogram::Percentile(h, 0.99) == 0);
+	}
+	{
+		// One value is every percentile
+		auto h = empty_histogram();
+		++h[Histogram::BucketIndex(1000)];
+		auto lower = Histogram::BucketLowerBound(Histogram::BucketIndex(1000));
+		assert(Histogram::Total(h) == 1);
+		assert(Histogram::Percentile(h, 0) == lower);
+		assert(Histogram::Percentile(h, 0.5) == lower);
+		assert(Histogram::Percentile(h, 1) == lower);
+	}
+	{
+		// 1 to 100, the q quantile is in the bucket of value q * 99 + 1
+		auto h = empty_histogram();
+		for (std::uint64_t v = 1; v <= 100; ++v){
+			++h[Histogram::BucketIndex(v)];
+		}
+		assert(Histogram::Total(h) == 100);
+		auto bucket_of = [](std::uint64_t v){
+			return Histogram::BucketLowerBound(Histogram::BucketIndex(v));
+		};
+		assert(Histogram::Percentile(h, 0) == 1);
+		assert(Histogram::Percentile(h, 0.5) == bucket_of(50));
+		assert(Histogram::Percentile(h, 0.9) == bucket_of(90));
+		assert(Histogram::Percentile(h, 0.99) == bucket_of(99));
+		assert(Histogram::Percentile(h, 1) == bucket_of(100));
+		// Quantiles never go down as q goes up
+		std::uint64_t previous = 0;
+		for (int i = 0; i <= 100; ++i){
+			auto p = Histogram::Percentile(h, i / 100.0);
+			assert(p >= previous);
+			previous = p;
+		}
+	}
+	{
+		// A slow tail shows in the high percentiles only
+		auto h = empty_histogram();
+		h[Histogram::BucketIndex(100)] += 990;
+		h[Histogram::BucketIndex(1000000)] += 10;
+		assert(Histogram::Percentile(h, 0.5) == Histogram::BucketLowerBound(Histogram::BucketIndex(100)));
+		assert(Histogram::Percentile(h, 0.98) == Histogram::BucketLowerBound(Histogram::BucketIndex(100)));
+		assert(Histogram::Percentile(h, 0.995) == Histogram::BucketLowerBound(Histogram::BucketIndex(1000000)));
+	}
+}
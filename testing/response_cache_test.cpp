@@ -0,0 +1,186 @@
+#include "unit_tests.hpp"
+#include <cppcomponents_libcurl_libuv/cppcomponents_libcurl_libuv.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+#include <assert.h>
+
+using namespace cppcomponents_libcurl_libuv;
+
+namespace{
+	typedef std::vector<std::pair<std::string, std::string>> header_list;
+
+	// A completed response, the way the cache sees one from the network
+	cppcomponents::use<IResponse> response(std::int32_t code, const header_list& headers, const std::string& body){
+		std::vector<cppcomponents::use<cppcomponents::IBuffer>> buffers;
+		if (!body.empty()){
+			auto b = cppcomponents::Buffer::Create(body.size());
+			std::memcpy(b.Begin(), body.data(), body.size());
+			b.SetSize(body.size());
+			buffers.push_back(b);
+		}
+		Response r{ cppcomponents::use<IEasy>{} };
+		r.QueryInterface<IResponseWriter2>().CompleteFrom(code, headers, buffers);
+		return r.QueryInterface<IResponse>();
+	}
+
+	header_list headers(const char* status, const char* name, const char* value){
+		header_list h;
+		h.push_back(std::make_pair(std::string{ status }, std::string{}));
+		h.push_back(std::make_pair(std::string{ name }, std::string{ value }));
+		return h;
+	}
+
+	std::string header(cppcomponents::use<IResponse> r, const char* name){
+		return r.QueryInterface<IResponse2>().Header(name).to_string();
+	}
+
+	ResponseCache make_cache(){
+		return ResponseCache{ static_cast<std::uint64_t>(1 << 20), static_cast<std::uint32_t>(1) };
+	}
+}
+
+void test_response_cache(){
+	{
+		// max-age makes it fresh, the hit shares the body
+		auto cache = make_cache();
+		assert(!cache.GetFresh("a"));
+		auto r = response(200, headers("HTTP/1.1 200 OK", "Cache-Control", "public, max-age=60"), "hello");
+		cache.Update("a", r, nullptr);
+		auto hit = cache.GetFresh("a");
+		assert(hit);
+		assert(hit.ResponseCode() == 200);
+		assert(hit.Body().to_string() == "hello");
+		auto c = cache.Counters();
+		assert(c[CacheCounter::Stores] == 1);
+		assert(c[CacheCounter::Hits] == 1);
+		assert(c[CacheCounter::Entries] == 1);
+	}
+	{
+		// Age counts against max-age
+		auto cache = make_cache();
+		auto h = headers("HTTP/1.1 200 OK", "Cache-Control", "max-age=60");
+		h.push_back(std::make_pair(std::string{ "Age" }, std::string{ "60" }));
+		h.push_back(std::make_pair(std::string{ "ETag" }, std::string{ "\"v1\"" }));
+		cache.Update("a", response(200, h, "x"), nullptr);
+		assert(!cache.GetFresh("a"));
+		assert(cache.GetStale("a"));
+	}
+	{
+		// Not stored: no-store, Vary, a status that is not cacheable, and a
+		// response without freshness or a validator
+		auto cache = make_cache();
+		cache.Update("a", response(200, headers("HTTP/1.1 200 OK", "Cache-Control", "max-age=60, no-store"), "x"), nullptr);
+		auto vary = headers("HTTP/1.1 200 OK", "Cache-Control", "max-age=60");
+		vary.push_back(std::make_pair(std::string{ "Vary" }, std::string{ "Accept" }));
+		cache.Update("b", response(200, vary, "x"), nullptr);
+		cache.Update("c", response(500, headers("HTTP/1.1 500 Internal Server Error", "Cache-Control", "max-age=60"), "x"), nullptr);
+		cache.Update("d", response(200, headers("HTTP/1.1 200 OK", "Content-Type", "text/plain"), "x"), nullptr);
+		assert(!cache.GetStale("a"));
+		assert(!cache.GetStale("b"));
+		assert(!cache.GetStale("c"));
+		assert(!cache.GetStale("d"));
+		assert(cache.Counters()[CacheCounter::Entries] == 0);
+	}
+	{
+		// no-store replaces what was stored for the key
+		auto cache = make_cache();
+		cache.Update("a", response(200, headers("HTTP/1.1 200 OK", "Cache-Control", "max-age=60"), "x"), nullptr);
+		assert(cache.GetFresh("a"));
+		cache.Update("a", response(200, headers("HTTP/1.1 200 OK", "Cache-Control", "no-store"), "y"), nullptr);
+		assert(!cache.GetStale("a"));
+	}
+	{
+		// no-cache with a validator is stored, but never fresh
+		auto cache = make_cache();
+		auto h = headers("HTTP/1.1 200 OK", "Cache-Control", "no-cache, max-age=60");
+		h.push_back(std::make_pair(std::string{ "ETag" }, std::string{ "\"v1\"" }));
+		cache.Update("a", response(200, h, "x"), nullptr);
+		assert(!cache.GetFresh("a"));
+		auto stale = cache.GetStale("a");
+		assert(stale);
+		assert(header(stale, "ETag") == "\"v1\"");
+	}
+	{
+		// A 304 keeps the stored body and status, and takes the new headers
+		auto cache = make_cache();
+		auto h = headers("HTTP/1.1 200 OK", "ETag", "\"v1\"");
+		h.push_back(std::make_pair(std::string{ "Content-Type" }, std::string{ "text/plain" }));
+		h.push_back(std::make_pair(std::string{ "Content-Length" }, std::string{ "5" }));
+		cache.Update("a", response(200, h, "hello"), nullptr);
+		auto stale = cache.GetStale("a");
+		assert(stale);
+		assert(!cache.GetFresh("a"));
+
+		auto not_modified = headers("HTTP/1.1 304 Not Modified", "Cache-Control", "max-age=60");
+		not_modified.push_back(std::make_pair(std::string{ "ETag" }, std::string{ "\"v2\"" }));
+		not_modified.push_back(std::make_pair(std::string{ "Content-Length" }, std::string{ "0" }));
+		auto merged = cache.Update("a", response(304, not_modified, ""), stale);
+		assert(merged.ResponseCode() == 200);
+		assert(merged.Body().to_string() == "hello");
+		assert(header(merged, "ETag") == "\"v2\"");
+		assert(header(merged, "Cache-Control") == "max-age=60");
+		assert(header(merged, "Content-Type") == "text/plain");
+		// The length is of the stored body, not of the 304
+		assert(header(merged, "Content-Length") == "5");
+		// The refreshed entry is fresh now
+		auto hit = cache.GetFresh("a");
+		assert(hit);
+		assert(hit.Body().to_string() == "hello");
+		assert(header(hit, "ETag") == "\"v2\"");
+		auto c = cache.Counters();
+		assert(c[CacheCounter::Revalidated] == 1);
+		assert(c[CacheCounter::Entries] == 1);
+	}
+	{
+		// A changed response replaces the stale one
+		auto cache = make_cache();
+		cache.Update("a", response(200, headers("HTTP/1.1 200 OK", "ETag", "\"v1\""), "old"), nullptr);
+		auto stale = cache.GetStale("a");
+		auto fresh = response(200, headers("HTTP/1.1 200 OK", "Cache-Control", "max-age=60"), "new");
+		auto r = cache.Update("a", fresh, stale);
+		assert(r.Body().to_string() == "new");
+		assert(cache.GetFresh("a").Body().to_string() == "new");
+		assert(cache.Counters()[CacheCounter::RevalidationChanged] == 1);
+	}
+	{
+		// Only the headers of the last response in a redirect chain count. The
+		// redirect's no-store does not stop the final response being stored
+		auto cache = make_cache();
+		auto h = headers("HTTP/1.1 301 Moved Permanently", "Cache-Control", "no-store");
+		h.push_back(std::make_pair(std::string{ "Location" }, std::string{ "/next" }));
+		h.push_back(std::make_pair(std::string{ "HTTP/1.1 200 OK" }, std::string{}));
+		h.push_back(std::make_pair(std::string{ "Cache-Control" }, std::string{ "max-age=60" }));
+		cache.Update("a", response(200, h, "x"), nullptr);
+		auto hit = cache.GetFresh("a");
+		assert(hit);
+		// Nor is anything of the redirect kept
+		assert(header(hit, "Location").empty());
+		auto kept = hit.Headers();
+		assert(kept.size() == 2);
+		assert(kept[0].first == "HTTP/1.1 200 OK");
+
+		// And the redirect's freshness does not make the final response fresh
+		auto h2 = headers("HTTP/1.1 301 Moved Permanently", "Cache-Control", "max-age=60");
+		h2.push_back(std::make_pair(std::string{ "HTTP/1.1 200 OK" }, std::string{}));
+		h2.push_back(std::make_pair(std::string{ "Content-Type" }, std::string{ "text/plain" }));
+		cache.Update("b", response(200, h2, "x"), nullptr);
+		assert(!cache.GetStale("b"));
+	}
+	{
+		// Remove and Clear
+		auto cache = make_cache();
+		auto h = headers("HTTP/1.1 200 OK", "Cache-Control", "max-age=60");
+		cache.Update("a", response(200, h, "x"), nullptr);
+		cache.Update("b", response(200, h, "y"), nullptr);
+		cache.Remove("a");
+		assert(!cache.GetStale("a"));
+		assert(cache.GetFresh("b"));
+		cache.Clear();
+		assert(!cache.GetStale("b"));
+		assert(cache.Counters()[CacheCounter::Bytes] == 0);
+	}
+}
@@ -0,0 +1,78 @@
+#include "unit_tests.hpp"
+#include <cppcomponents_libcurl_libuv/http_client.hpp>
+
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <assert.h>
+
+using namespace cppcomponents_libcurl_libuv;
+
+namespace{
+	Request backoff(std::uint32_t base, std::uint32_t max){
+		Request req{ "http://example.com/a" };
+		req.RetryBaseDelay = base;
+		req.RetryMaxDelay = max;
+		return req;
+	}
+
+	// Every wait after retry retries is in [cap / 2, cap], returns the largest
+	std::uint32_t check_delays(const Request& req, std::uint32_t retry, std::uint64_t cap, std::minstd_rand& rng){
+		std::uint32_t largest = 0;
+		for (int i = 0; i < 1000; ++i){
+			auto d = HttpClient::RetryDelay(req, retry, rng);
+			assert(d >= cap / 2);
+			assert(d <= cap);
+			if (d > largest){
+				largest = d;
+			}
+		}
+		return largest;
+	}
+}
+
+void test_retry_backoff(){
+	std::minstd_rand rng{ 1 };
+	{
+		// Doubles from the base delay up to the max
+		auto req = backoff(100, 10000);
+		std::uint64_t expected[] = { 100, 200, 400, 800, 1600, 3200, 6400, 10000, 10000 };
+		for (std::uint32_t retry = 0; retry < sizeof(expected) / sizeof(expected[0]); ++retry){
+			check_delays(req, retry, expected[retry], rng);
+		}
+		// The wait is spread over the upper half, not stuck at one end
+		auto largest = check_delays(req, 3, 800, rng);
+		assert(largest > 700);
+	}
+	{
+		// Many retries stay at the max without overflowing
+		auto req = backoff(100, 10000);
+		check_delays(req, 64, 10000, rng);
+		check_delays(req, 1000, 10000, rng);
+		check_delays(req, std::numeric_limits<std::uint32_t>::max(), 10000, rng);
+		auto big = backoff(std::numeric_limits<std::uint32_t>::max() / 2 + 1, std::numeric_limits<std::uint32_t>::max());
+		check_delays(big, 1, std::numeric_limits<std::uint32_t>::max(), rng);
+		check_delays(big, 40, std::numeric_limits<std::uint32_t>::max(), rng);
+	}
+	{
+		// A base above the max is held to the max
+		auto req = backoff(5000, 1000);
+		check_delays(req, 0, 1000, rng);
+		check_delays(req, 3, 1000, rng);
+	}
+	{
+		// No base delay, or no max, retries right away
+		auto none = backoff(0, 10000);
+		assert(HttpClient::RetryDelay(none, 0, rng) == 0);
+		assert(HttpClient::RetryDelay(none, 10, rng) == 0);
+		auto zero_max = backoff(100, 0);
+		assert(HttpClient::RetryDelay(zero_max, 0, rng) == 0);
+		assert(HttpClient::RetryDelay(zero_max, 5, rng) == 0);
+	}
+	{
+		// A cap of 1 waits 0 or 1
+		auto req = backoff(1, 1);
+		check_delays(req, 0, 1, rng);
+		check_delays(req, 7, 1, rng);
+	}
+}
@@ -0,0 +1,171 @@
+#include "unit_tests.hpp"
+#include <cppcomponents_libcurl_libuv/implementation/scheduler.hpp>
+
+#include <string>
+#include <vector>
+#include <assert.h>
+
+using cppcomponents_libcurl_libuv::detail::transfer_scheduler;
+
+namespace{
+	enum { high = 0, normal = 1, low = 2 };
+	typedef transfer_scheduler<std::string, 3> scheduler;
+
+	// Takes transfers until the scheduler has none that may start, marking
+	// each started
+	std::vector<std::string> drain(scheduler& s){
+		std::vector<std::string> order;
+		std::string item;
+		std::string host;
+		while (s.next(item, host)){
+			s.started(host);
+			order.push_back(item);
+		}
+		return order;
+	}
+}
+
+void test_scheduler_fairness(){
+	{
+		// With nothing waiting and no limits transfers skip the queues
+		scheduler s;
+		assert(s.can_start("a"));
+		s.started("a");
+		assert(s.can_start("a"));
+	}
+	{
+		// Higher classes go first, FIFO within a host and class
+		scheduler s;
+		s.set_max_active(1);
+		s.started("a");
+		assert(!s.can_start("b"));
+		s.push("a", normal, "n1");
+		s.push("a", low, "l1");
+		s.push("a", normal, "n2");
+		s.push("b", high, "h1");
+		assert(s.waiting() == 4);
+		// No room until the running transfer finishes
+		std::string item;
+		std::string host;
+		assert(!s.next(item, host));
+		s.finished("a");
+		s.set_max_active(0);
+		auto order = drain(s);
+		std::vector<std::string> expected = { "h1", "n1", "n2", "l1" };
+		assert(order == expected);
+		assert(s.waiting() == 0);
+	}
+	{
+		// Hosts take turns instead of the order they were queued in
+		scheduler s;
+		s.set_max_active(1);
+		s.started("x");
+		s.push("a", normal, "a1");
+		s.push("a", normal, "a2");
+		s.push("a", normal, "a3");
+		s.push("b", normal, "b1");
+		s.push("b", normal, "b2");
+		s.push("c", normal, "c1");
+		s.finished("x");
+		s.set_max_active(0);
+		auto order = drain(s);
+		std::vector<std::string> expected = { "a1", "b1", "c1", "a2", "b2", "a3" };
+		assert(order == expected);
+	}
+	{
+		// A host at its limit does not hold up the others
+		scheduler s;
+		s.set_max_active_per_host(2);
+		s.started("a");
+		s.started("a");
+		assert(!s.can_start("a"));
+		assert(s.can_start("b"));
+		s.push("a", high, "a1");
+		s.push("a", high, "a2");
+		s.push("b", normal, "b1");
+		s.push("b", normal, "b2");
+		s.push("b", normal, "b3");
+		auto order = drain(s);
+		std::vector<std::string> expected = { "b1", "b2" };
+		assert(order == expected);
+		assert(s.active() == 4);
+		assert(s.waiting() == 3);
+		// Each finish on a host lets one more of its transfers start
+		s.finished("a");
+		order = drain(s);
+		expected.assign(1, "a1");
+		assert(order == expected);
+		s.finished("b");
+		order = drain(s);
+		expected.assign(1, "b3");
+		assert(order == expected);
+		s.finished("a");
+		order = drain(s);
+		expected.assign(1, "a2");
+		assert(order == expected);
+		assert(s.waiting() == 0);
+	}
+	{
+		// The total limit holds across hosts
+		scheduler s;
+		s.set_max_active(2);
+		s.started("x");
+		s.push("a", normal, "a1");
+		s.push("b", normal, "b1");
+		s.push("c", normal, "c1");
+		auto order = drain(s);
+		std::vector<std::string> expected = { "a1" };
+		assert(order == expected);
+		assert(s.active() == 2);
+		s.finished("x");
+		order = drain(s);
+		expected.assign(1, "b1");
+		assert(order == expected);
+	}
+	{
+		// Waiting transfers can be taken out, the host keeps its turn
+		scheduler s;
+		s.set_max_active(1);
+		s.started("x");
+		s.push("a", normal, "a1");
+		s.push("a", normal, "a2");
+		s.push("b", normal, "b1");
+		std::string item;
+		auto is = [](const char* name){
+			return [name](const std::string& w){ return w == name; };
+		};
+		assert(s.remove("a", is("a1"), item));
+		assert(item == "a1");
+		assert(!s.remove("a", is("a1"), item));
+		assert(!s.remove("c", is("c1"), item));
+		assert(s.waiting() == 2);
+		s.finished("x");
+		s.set_max_active(0);
+		auto order = drain(s);
+		std::vector<std::string> expected = { "a2", "b1" };
+		assert(order == expected);
+	}
+	{
+		// A host whose transfers were all removed is skipped
+		scheduler s;
+		s.set_max_active(1);
+		s.started("x");
+		s.push("a", normal, "a1");
+		s.push("b", normal, "b1");
+		std::string item;
+		assert(s.remove("a", [](const std::string& w){ return w == "a1"; }, item));
+		s.finished("x");
+		auto order = drain(s);
+		std::vector<std::string> expected = { "b1" };
+		assert(order == expected);
+		// A transfer that could not be started releases its host
+		s.finished("b");
+		s.push("c", normal, "c1");
+		std::string host;
+		assert(s.next(item, host));
+		assert(host == "c");
+		s.release(host);
+		assert(s.active() == 0);
+		assert(s.can_start("c"));
+	}
+}
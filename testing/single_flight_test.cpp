@@ -0,0 +1,110 @@
+#include "unit_tests.hpp"
+#include <cppcomponents_libcurl_libuv/http_client.hpp>
+
+#include <string>
+#include <utility>
+#include <vector>
+#include <assert.h>
+
+using namespace cppcomponents_libcurl_libuv;
+
+namespace{
+	void add_header(Request& req, const char* name, const char* value){
+		req.Headers.push_back(std::make_pair(std::string{ name }, std::string{ value }));
+	}
+
+	std::string key(const Request& req){
+		return SingleFlight::Key(req, std::vector<std::string>{});
+	}
+
+	// Requests that differ from base only in what change does
+	template<class F>
+	bool same_key(F change){
+		Request base{ "http://example.com/a" };
+		Request other = base;
+		change(other);
+		return key(base) == key(other);
+	}
+}
+
+void test_single_flight_key(){
+	{
+		Request a{ "http://example.com/a" };
+		Request b{ "http://example.com/a" };
+		assert(key(a) == key(b));
+		Request c{ "http://example.com/b" };
+		assert(key(a) != key(c));
+	}
+	{
+		// All headers count by default, in any order and case of name
+		Request a{ "http://example.com/a" };
+		add_header(a, "Accept", "text/html");
+		add_header(a, "X-Tenant", "1");
+		Request b{ "http://example.com/a" };
+		add_header(b, "x-tenant", "1");
+		add_header(b, "ACCEPT", "text/html");
+		assert(key(a) == key(b));
+		Request c{ "http://example.com/a" };
+		add_header(c, "Accept", "text/html");
+		add_header(c, "X-Tenant", "2");
+		assert(key(a) != key(c));
+		Request d{ "http://example.com/a" };
+		add_header(d, "Accept", "text/html");
+		assert(key(a) != key(d));
+	}
+	{
+		// Options that change the response
+		assert(same_key([](Request& r){ r.Priority = TransferPriority::High; }));
+		assert(same_key([](Request& r){ r.HedgeDelay = 50; }));
+		assert(!same_key([](Request& r){ r.FollowRedirects = false; }));
+		assert(!same_key([](Request& r){ r.MaxRedirects = 2; }));
+		assert(!same_key([](Request& r){ r.UseGzip = false; }));
+		assert(!same_key([](Request& r){ r.HttpVersion = 2; }));
+		assert(!same_key([](Request& r){ r.Referer = "http://example.com/"; }));
+		assert(!same_key([](Request& r){ r.UserAgent = "test"; }));
+		assert(!same_key([](Request& r){ r.ProxyHost = "proxy"; }));
+		assert(!same_key([](Request& r){ r.ProxyPort = 3128; }));
+		assert(!same_key([](Request& r){ r.ClientCert = "cert.pem"; }));
+		assert(!same_key([](Request& r){ r.ClientKey = "key.pem"; }));
+		assert(!same_key([](Request& r){ r.ValidateCert = false; }));
+		assert(!same_key([](Request& r){ r.Username = "user"; }));
+		assert(!same_key([](Request& r){ r.Password = "secret"; }));
+		assert(!same_key([](Request& r){ r.AuthMode = 1; }));
+		assert(!same_key([](Request& r){ r.Cookie = "id=1"; }));
+		assert(!same_key([](Request& r){ r.RequestTimeout = 1000; }));
+	}
+	{
+		// One value cannot pass for two
+		Request a{ "http://example.com/a" };
+		a.Username = "ab";
+		Request b{ "http://example.com/a" };
+		b.Username = "a";
+		b.Password = "b";
+		assert(key(a) != key(b));
+	}
+	{
+		// A vary list leaves out the headers it does not name, but never
+		// credentials or cookies
+		std::vector<std::string> vary{ "Accept" };
+		Request a{ "http://example.com/a" };
+		add_header(a, "Accept", "text/html");
+		add_header(a, "X-Trace", "1");
+		Request b{ "http://example.com/a" };
+		add_header(b, "accept", "text/html");
+		add_header(b, "X-Trace", "2");
+		assert(SingleFlight::Key(a, vary) == SingleFlight::Key(b, vary));
+		Request c = a;
+		c.Headers[0].second = "application/json";
+		assert(SingleFlight::Key(a, vary) != SingleFlight::Key(c, vary));
+		Request d = a;
+		add_header(d, "Authorization", "Bearer x");
+		assert(SingleFlight::Key(a, vary) != SingleFlight::Key(d, vary));
+		Request e = a;
+		add_header(e, "Cookie", "id=1");
+		assert(SingleFlight::Key(a, vary) != SingleFlight::Key(e, vary));
+		// Options count whatever the vary list
+		Request f = a;
+		f.FollowRedirects = false;
+		assert(SingleFlight::Key(a, vary) != SingleFlight::Key(f, vary));
+	}
+}
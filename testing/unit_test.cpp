@@ -19,6 +19,7 @@ namespace{
 #include <cppcomponents_async_coroutine_wrapper/cppcomponents_resumable_await.hpp>
 #include <cppcomponents_libuv/cppcomponents_libuv.hpp>
 #include <cppcomponents/loop_executor.hpp>
+#include "unit_tests.hpp"
 
 #include <iostream>
 #include <assert.h>
@@ -57,6 +58,14 @@ int async_main(cppcomponents::awaiter await){
 }
 
 int main(){
+    test_header_index();
+    test_scheduler_fairness();
+    test_histogram();
+    test_response_cache();
+    test_disk_cache();
+    test_single_flight_key();
+    test_retry_backoff();
+
     cppcomponents::LoopExecutor exec;
     new char[50];
     auto am = cppcomponents::resumable(async_main);
@@ -0,0 +1,16 @@
+#pragma once
+#ifndef INCLUDE_GUARD_CPPCOMPONENTS_LIBCURL_LIBUV_TESTING_UNIT_TESTS_HPP_
+#define INCLUDE_GUARD_CPPCOMPONENTS_LIBCURL_LIBUV_TESTING_UNIT_TESTS_HPP_
+
+// Tests that need no network, run by unit_test.cpp before the fetches. Each
+// one asserts on failure
+
+void test_header_index();
+void test_scheduler_fairness();
+void test_histogram();
+void test_response_cache();
+void test_disk_cache();
+void test_single_flight_key();
+void test_retry_backoff();
+
+#endif